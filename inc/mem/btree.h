@@ -26,23 +26,84 @@
 #define BTREE_H
 
 #include "LPC11xx.h"
+#include "mem/flash.h"
+
+/**
+ * Selects the compact record layout, where the time base and record
+ * flags live in a header at the start of each page and each record
+ * only stores a time delta and an index into the flags table. Undefine
+ * this to go back to the original 24-byte records.
+ */
+#define COMPACT_RECORDS
 
 enum {
+  /**
+   * This is the number of bytes in a full record, which is what we
+   * checksum and what we upload. 6*4 = 24
+   */
+  FULL_RECORD_SIZE		= 24,
+#ifdef COMPACT_RECORDS
+  /**
+   * This is the number of bytes stored in memory for each
+   * reading. 4*4 = 16
+   */
+  RECORD_SIZE			= 16,
+  /**
+   * This is the number of bytes at the start of each page reserved
+   * for the branch header.
+   */
+  BRANCH_HEADER_SIZE		= 128,
+  /**
+   * This is the integer number of blocks that fit in a page after the
+   * header. (65536-128)/16 = 4088. This also has to fit in the 4096
+   * leaves a branch sector has room for.
+   */
+  MAX_RECORDS_PER_BRANCH	= 4088,
+#else
   /**
    * This is the number of bytes stored in memory for each
    * reading. 6*4 = 24
    */
   RECORD_SIZE			= 24,
+  /**
+   * There is no branch header on the original layout.
+   */
+  BRANCH_HEADER_SIZE		= 0,
   /**
    * This is the integer number of blocks that fit in a page. 65536/24
    * = 2730.67 => 2730
    */
   MAX_RECORDS_PER_BRANCH	= 2730,
+#endif
   /**
-   * This could be anywhere between 2 and 1024, but keeping it short
-   * will probably give the best performance.
+   * The root is rewritten further along its sector each time a branch
+   * is activated, and the sector's only erased once it's used up. It's
+   * found by bisection, so it can take up the whole sector bar the
+   * erase count at the end. (4096-4)/2 = 2046
    */
-  ROOT_SIZE			= 32
+  ROOT_SIZE			= 2046,
+  /**
+   * The last word of each root and branch sector is past anything
+   * else in it. It holds how many times the sector has been erased,
+   * and is written back after each erase.
+   */
+  ERASE_COUNT_OFFSET		= 0xFFC,
+  /**
+   * What's read back when the count was never written, as on a new
+   * chip or after a reset between an erase and writing the count back.
+   */
+  ERASE_COUNT_UNKNOWN		= 0xFFFF,
+  /**
+   * Writing in order wears the branches evenly, so we only skip one
+   * when it's been erased this many times more than the least worn
+   * erased branch.
+   */
+  WEAR_LEVEL_SLACK		= 8,
+  /**
+   * Each 1 MByte of a chip holds its own tree, so this is 16 for each
+   * chip the flash queue knows about.
+   */
+  MAX_TREES			= FLASH_MAX_CHIPS*16,
 };
 
 /**
@@ -51,14 +112,42 @@ enum {
 enum {
   MEM_INVALID	=	1,
   MEM_VALID	= 	2,
-  MEM_ERASED	= 	4
+  MEM_ERASED	= 	4,
+  MEM_RESERVED	=	8
+};
+
+/**
+ * What's stored in a leaf. A leaf is reserved before its record is
+ * written and committed once the record is in memory, so each step
+ * only takes bits from 1 to 0. A reserved leaf found at boot means the
+ * write was torn.
+ */
+enum {
+  LEAF_ERASED		= 0xFF,
+  LEAF_RESERVED		= 0x72,
+  LEAF_VALID		= 0x52,
+  LEAF_INVALID		= 0x00,
 };
 
 void activate_branch_on_root(uint32_t address);
 void deactivate_branch_on_root(uint32_t address);
 
 uint32_t leaf_addr_to_record_addr(uint32_t leaf_addr);
+uint8_t get_leaf_status(uint32_t address);
+uint32_t find_branch_tail(uint32_t address);
+uint16_t get_root(uint32_t address);
+uint32_t next_active_branch(uint16_t root, uint32_t current_branch_address);
 uint32_t first_root(void);
+uint32_t next_root(uint32_t address, uint8_t wrap);
+void skip_rest_of_branch(uint32_t* leaf_marker_addr);
+
+void erase_counted_sector(uint32_t address);
+uint16_t get_erase_count(uint32_t address);
+uint16_t fewest_erases(uint32_t address);
+void erase_branch(uint32_t address);
+void mark_for_reclaim(uint32_t leaf_addr);
+void init_reclaim(void);
+uint32_t reclaim_branch(uint32_t address);
 
 /**
  * Returns the address of the next record following the marker_addr
@@ -27,11 +27,29 @@
 
 #include "LPC11xx.h"
 
+/**
+ * How the CRC is worked out. Define one of these here or with -D:
+ *
+ * CRC_NIBBLE_TABLE	16 entry table, 64 bytes of ROM. Two lookups a byte.
+ * CRC_BYTE_TABLE	256 entry table, 1 KB of ROM. One lookup a byte.
+ * CRC_SLICING_BY_4	Four 256 entry tables, 4 KB of ROM. Four lookups
+ *			every four bytes.
+ *
+ * `make crc` in sim/ reports the speed and size of each.
+ */
+#if !defined(CRC_NIBBLE_TABLE) && !defined(CRC_BYTE_TABLE) && \
+  !defined(CRC_SLICING_BY_4)
+#define CRC_NIBBLE_TABLE
+#endif
+
 enum {
   CHECKSUM_PASS	= 1,
   CHECKSUM_FAIL	= 0,
 };
 
+uint32_t crc32_start(void);
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint16_t length);
+uint32_t crc32_finish(uint32_t crc);
 uint32_t calculate_checksum(uint8_t* block);
 uint32_t get_checksum(uint8_t* block);
 uint8_t evaluate_checksum(uint8_t* block);
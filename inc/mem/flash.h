@@ -28,12 +28,117 @@
 #include "LPC11xx.h"
 
 /**
- * The sizes of the memory chips in bytes
+ * Pace automatic writes from the chip's RY/BY# output on SO rather
+ * than a fixed TMR32B1 tick. Undefine this to go back to the timer.
  */
-uint32_t flash_sizes[0x100];
+#define FLASH_HARDWARE_BUSY
 
 /**
- * Globals needed for access during interrupt
+ * Called when a queued command has completed, with the address the
+ * command was queued with.
+ */
+typedef void (*flash_callback)(uint32_t address);
+
+struct flash_command {
+  uint8_t command;
+  uint8_t value; /* For byte writes */
+  uint32_t address;
+  uint8_t* data; /* For automatic writes */
+  uint32_t len;
+  flash_callback callback;
+};
+
+enum {
+  FLASH_QUEUE_LENGTH	= 8,
+  /**
+   * A stream clocks through gaps up to this long rather than starting
+   * a new read, which costs the command, address and dummy byte.
+   */
+  FLASH_STREAM_SKIP	= 5,
+  /**
+   * The number of sockets wired up in flash_sockets.
+   */
+  FLASH_MAX_CHIPS	= 3,
+};
+
+/**
+ * Commands that can be queued
+ */
+enum {
+  FLASHQ_AUTO_WRITE	= 0,
+  FLASHQ_BYTE_WRITE	= 1,
+  FLASHQ_SECTOR_ERASE	= 2,
+  FLASHQ_PAGE_ERASE	= 3,
+  FLASHQ_CHIP_ERASE	= 4,
+  FLASHQ_WAIT		= 5,
+};
+
+/**
+ * What we know about the part in each socket, from its JEDEC ID and
+ * SFDP tables. Parts without AAI program a page at a time.
+ */
+struct flash_part {
+  uint32_t size; /* Bytes, up to 16 MByte with three byte addresses */
+  uint16_t page_size; /* Bytes per page program, or 0 to use AAI */
+  uint8_t sector_erase; /* 4 KByte erase command */
+  uint8_t block_erase; /* 64 KByte erase command */
+  uint32_t program_ticks; /* TMR32B1 ticks between polls of a write */
+  uint32_t erase_ticks; /* And of an erase */
+};
+
+/**
+ * Each chip has its own command queue, so an erase on one chip
+ * doesn't hold up anything on the others. The command at the head is
+ * the one in progress.
+ */
+struct flash_chip {
+  struct flash_command queue[FLASH_QUEUE_LENGTH];
+  uint8_t head;
+  uint8_t count;
+  uint8_t state;
+  uint32_t ticks; /* TMR32B1 ticks until we next look at the chip */
+  uint8_t unprotected; /* Status register cleared since the last reset */
+  uint32_t written; /* Bytes of a page programmed write that have gone in */
+  struct flash_part part;
+};
+
+struct flash_chip flash_chips[FLASH_MAX_CHIPS];
+
+/**
+ * The sizes of the memory chips in bytes, or 0 for an empty socket
+ */
+uint32_t flash_sizes[FLASH_MAX_CHIPS];
+
+/**
+ * A read that's kept going across calls, so consecutive reads don't
+ * each send the command and address. The chip's selected and the
+ * interrupts are off while it's open, so nothing else can use the SPI
+ * bus or the flash until it's closed.
+ */
+struct flash_stream {
+  uint32_t address; /* Of the next byte */
+  uint32_t primask; /* To put back when it's closed */
+  uint8_t chip; /* That's selected */
+  uint8_t open;
+};
+
+/**
+ * The chip select line wired to a socket.
+ */
+struct flash_socket {
+  LPC_GPIO_TypeDef* port;
+  uint8_t pin;
+};
+
+enum {
+  FLASHCHIP_IDLE	= 0, /* Nothing started */
+  FLASHCHIP_TIMED	= 1, /* Waiting on TMR32B1 */
+  FLASHCHIP_AUTO	= 2, /* Automatic write waiting on RY/BY# */
+};
+
+/**
+ * Globals needed for access during interrupt. Only one chip can be
+ * doing an automatic write at a time.
  */
 uint32_t writeflash_address;
 uint32_t writeflash_len;
@@ -47,6 +152,22 @@ enum {
   WRITEFLASH_FINISHING	= 2,
 };
 
+/**
+ * TMR32B1 timings for the command queue. On a 12MHz clock these are
+ * about 100µs between automatic writes, about 45µs for a byte write
+ * and about 1ms between polls while an erase is running. RY/BY# is
+ * only available during automatic writes, so erases and byte writes
+ * are always timed. Parts that describe themselves in SFDP get their
+ * own program and erase timings.
+ */
+enum {
+  FLASH_TICK_PRESCALE	= 25,
+  FLASH_WRITE_TICK	= 48,
+  FLASH_BYTE_TICK	= 21,
+  FLASH_ERASE_TICK	= 480,
+  FLASH_TICKS_PER_MS	= 461, /* 12MHz / (FLASH_TICK_PRESCALE+1) */
+};
+
 struct flashinfo {
   uint8_t man_id;
   uint8_t dev_id;
@@ -75,6 +196,8 @@ enum {
   FLASH_BUSY_ENABLE		= 0x70,
   FLASH_BUSY_DISABLE		= 0x80,
   FLASH_JEDEC_ID		= 0x9F,
+  FLASH_READ_SFDP		= 0x5A,
+  FLASH_PAGE_PROGRAM		= 0x02, /* The same as a byte write, with more bytes */
   FLASH_ENABLE_HOLD		= 0xAA,
 };
 /**
@@ -103,17 +226,38 @@ struct flashinfo ReadChipInfo(uint32_t address);
 uint8_t ReadFlashByte(uint32_t address);
 void WriteFlashByte(uint32_t address, uint8_t data);
 uint8_t ReadFlashAND(uint32_t address, uint32_t size);
+uint8_t ReadFlashOR(uint32_t address, uint32_t size);
 uint8_t ReadFlash(uint32_t address, uint8_t* buffer, uint32_t size);
+uint8_t CompareFlash(uint32_t address, uint8_t* buffer, uint32_t size);
+
+/* ---- STREAMING READS ---- */
+void OpenFlashStream(struct flash_stream* stream, uint32_t address);
+void SeekFlashStream(struct flash_stream* stream, uint32_t address);
+void ReadFlashStream(struct flash_stream* stream, uint8_t* buffer, uint32_t size);
+void CloseFlashStream(struct flash_stream* stream);
 
 /* ---- WORD READ/WRITE ---- */
 void WriteFlashWord(uint32_t address, uint16_t word);
 uint16_t ReadFlashWord(uint32_t address);
 
 /* ---- AUTOMATIC WRITE ---- */
-void StartWriteFlash(uint32_t address, uint8_t* record, uint32_t len);
+void StartWriteFlash(uint32_t address, uint8_t* record, uint32_t len, flash_callback callback);
 extern void PIOINT0_IRQHandler(void);
 void EndWriteFlash();
 
+/* ---- COMMAND QUEUE ---- */
+void StartWriteFlashByte(uint32_t address, uint8_t data, flash_callback callback);
+void StartSectorErase(uint32_t address, flash_callback callback);
+void StartPageErase(uint32_t address, flash_callback callback);
+void StartChipErase(uint32_t address, flash_callback callback);
+void StartWaitForBusyClear(uint32_t address, flash_callback callback);
+void StepFlashQueue(void);
+uint8_t FlashChipBusy(uint32_t address);
+void WaitForFlashChip(uint32_t address);
+void WaitForAutoWrite(void);
+void WaitForFlashQueue(void);
+uint32_t ClaimSharedBus(void);
+
 /* ---- LOCATION HELPERS ---- */
 uint32_t NextChip(uint32_t address, uint8_t wrap);
 uint32_t NextPage(uint32_t address);
@@ -25,6 +25,33 @@
 #ifndef INVALIDATE_H
 #define INVALIDATE_H
 
+enum {
+  /**
+   * Acked leaves are saved up and invalidated together, for each run
+   * of this many leaves. It's a power of two, so a run never crosses
+   * into the next branch.
+   */
+  INVALIDATE_BATCH_LEAVES =	64,
+  /**
+   * The number of acks that can wait in the queue between the radio
+   * interrupt and main context. An upload window's worth.
+   */
+  ACKED_QUEUE_LENGTH =		16,
+};
+
+/**
+ * Some acked leaves, from leaf on.
+ */
+struct acked_leaves {
+  uint32_t leaf;
+  uint8_t bitmap;
+};
+
+void invalidate(uint32_t leaf_addr);
+void collect_invalidations(void);
+void flush_invalidations(void);
 void check_and_invalidate(uint32_t leaf_addr, uint32_t radio_checksum);
+void check_and_invalidate_bitmap(uint32_t leaf_addr, uint8_t bitmap,
+				 uint32_t radio_checksum);
 
 #endif /* INVALIDATE_H */
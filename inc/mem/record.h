@@ -0,0 +1,38 @@
+/* 
+ * Converts records between their stored and full layouts
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "LPC11xx.h"
+#include "mem/flash.h"
+
+uint8_t pack_record(uint32_t record_addr, uint32_t* full, uint32_t* packed);
+void read_full_record(uint32_t leaf_addr, uint32_t* full);
+void stream_full_record(struct flash_stream* stream, uint32_t leaf_addr, uint32_t* full);
+uint64_t read_record_time(uint32_t leaf_addr);
+uint32_t read_record_flags(uint32_t leaf_addr);
+void forget_branch_header(uint32_t page_addr);
+
+#endif /* RECORD_H */
@@ -0,0 +1,72 @@
+/* 
+ * Makes space for new records by decimating the oldest ones
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include "LPC11xx.h"
+
+enum {
+  /**
+   * Once there are fewer erased branches than this, two old full
+   * branches are decimated into one.
+   */
+  RETENTION_MIN_FREE_BRANCHES	= 2,
+  /**
+   * The number of different record flags we can be holding on to while
+   * we wait for the next record to merge with. That's em and battery
+   * records, and the three statistics for each roll-up tier.
+   */
+  RETENTION_PENDING		= 8,
+  /**
+   * The number of merged records held so they can be put in time
+   * order. A battery record waits for the next one for about as long
+   * as 5 merged em records and 6 merged roll-ups take.
+   */
+  RETENTION_READY		= 16,
+  /**
+   * The number of times a record can be decimated that we keep track
+   * of. Each one doubles the time it covers.
+   */
+  RETENTION_LEVELS		= 16,
+  /**
+   * The number of leaves taken from the old branches on each wake.
+   * A decimation takes a few hundred wakes this way.
+   */
+  RETENTION_LEAVES_AT_ONCE	= 32,
+};
+
+/**
+ * Counts of what decimation has done since boot. Records are only
+ * dropped when they don't fit on the new branch.
+ */
+uint32_t retention_decimations;
+uint32_t retention_dropped;
+
+void retain_space(uint32_t write_leaf);
+void decimate_some(void);
+void finish_decimation(void);
+uint8_t decimating_into(uint32_t leaf_addr);
+
+#endif /* RETENTION_H */
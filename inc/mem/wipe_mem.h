@@ -1,5 +1,5 @@
 /* 
- * Wipes the whole memory, no questions asked. Used when debugging.
+ * Wipes the whole memory when the gateway asks for it
  * Copyright (C) 2013  Richard Meadows
  * 
  * Permission is hereby granted, free of charge, to any person obtaining
@@ -25,6 +25,14 @@
 #ifndef WIPE_MEM_H
 #define WIPE_MEM_H
 
+#include "LPC11xx.h"
+
+/**
+ * Set by the radio when the gateway asks for a wipe, and picked up at
+ * the end of the next wake.
+ */
+uint8_t wipe_requested;
+
 void wipe_mem(void);
 
 #endif /* WIPE_MEM_H */
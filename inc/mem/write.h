@@ -25,9 +25,62 @@
 #ifndef WRITE_H
 #define WRITE_H
 
+#include "LPC11xx.h"
+
+/**
+ * Read each flush back once it's in memory. Records that didn't go in
+ * properly have their leaves retired and are written again on the
+ * leaves that follow, rather than being rejected by the base station
+ * later. Undefine this to save the time it takes.
+ */
+#define VERIFY_WRITES
+
+enum {
+  /**
+   * The number of records we hold in RAM so they can be written out
+   * together. RAM is kept in deep sleep, but a reset loses whatever
+   * is waiting here.
+   */
+  WRITE_QUEUE_LENGTH = 4,
+  /**
+   * The number of times we'll write records that don't read back
+   * properly again before giving up on them.
+   */
+  VERIFY_ATTEMPTS = 3,
+};
+
+/**
+ * The leaf after the last one the last flush used, including any
+ * records that had to be written again.
+ */
+uint32_t flush_end_leaf;
+/**
+ * A marker that every valid leaf comes after, so uploads can start
+ * looking from here rather than from the first root. Writing behind it
+ * moves it back, and upload() moves it on past the leaves that have
+ * been acked. It's only kept in RAM, so a reset puts it back to the
+ * first root.
+ */
+uint32_t oldest_leaf_marker;
+/**
+ * Counts of records that didn't read back properly since boot, and of
+ * those we gave up on.
+ */
+uint32_t verify_failures;
+uint32_t verify_dropped;
+/**
+ * The count of erased leaves passed over since boot because a record
+ * wouldn't fit on their branch. They're not used until the writer
+ * comes back round to them.
+ */
+uint32_t write_leaves_skipped;
+
 void write_sample_to_mem(uint32_t record_flags, uint32_t left_data,
 			 uint32_t right_data, uint32_t time_ago);
+void flush_writes(void);
+void write_records(uint32_t leaf_addr, uint32_t* records, uint8_t count);
 void wait_for_write_complete(void);
 void init_write(void);
+void reclaim_ahead(void);
 
 #endif /* WRITE_H */
@@ -82,6 +82,9 @@ struct radif {
   uint16_t tx_invalid;
 
   uint16_t last_trac_status;
+  /* Set from the start of a transmission until it's been dealt with,
+     along with any reply */
+  volatile uint8_t tx_in_progress;
 };
 
 /**
@@ -35,5 +35,6 @@ void radio_transmit(uint8_t* data, uint8_t length, uint16_t destination,
 void radio_sleep(void);
 void radio_wake(void);
 uint16_t radio_get_trac_status(void);
+uint16_t radio_wait_for_tx_end(void);
 
 #endif /* RADIO_H */
@@ -0,0 +1,63 @@
+/* 
+ * Rolls readings up into records over longer periods
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "LPC11xx.h"
+
+enum {
+  /**
+   * The most tiers there can be. Their lengths are set in settings.c
+   */
+  MAX_ROLLUP_TIERS	= 3,
+  /**
+   * We take a reading every 500 ms
+   */
+  READINGS_PER_SECOND	= 2,
+  /**
+   * Roll-up records have this where the left frequency would be
+   */
+  ROLLUP_RECORD_TYPE	= 59,
+};
+
+/**
+ * Each period on each tier is written as three records. The mean
+ * times the tier's length gives the sum, and there are always as
+ * many readings as fit in the tier: it's started again if the time
+ * goes wrong part way through.
+ */
+enum rollup_statistic {
+  ROLLUP_MEAN		= 0,	/* Left mean, right mean */
+  ROLLUP_LEFT_RANGE	= 1,	/* Left minimum, left maximum */
+  ROLLUP_RIGHT_RANGE	= 2,	/* Right minimum, right maximum */
+};
+
+#define IS_ROLLUP_RECORD(flags)	(((flags) >> 26) == ROLLUP_RECORD_TYPE)
+#define ROLLUP_STATISTIC(flags)	(((flags) >> 24) & 0x3)
+
+void rollup_reading(uint32_t left, uint32_t right);
+void rollup_reset(void);
+
+#endif /* ROLLUP_H */
@@ -33,6 +33,8 @@ uint32_t get_battery_record_flags(void);
 uint32_t get_rssi_record_flags(void);
 uint32_t get_time_jump_record_flags(void);
 uint32_t get_envelope_record_flags(void);
+uint32_t get_rollup_record_flags(uint8_t tier, uint8_t statistic);
+uint16_t get_rollup_tier_seconds(uint8_t tier);
 uint8_t get_left_tuned_bin(void);
 uint8_t get_right_tuned_bin(void);
 
@@ -44,4 +46,9 @@ uint8_t get_right_pga_gain(void);
 uint8_t get_left_micboost(void);
 uint8_t get_right_micboost(void);
 
+/**
+ * ======== Uploads ========
+ */
+uint8_t get_upload_window(void);
+
 #endif /* SETTINGS_H */
@@ -25,6 +25,16 @@
 #ifndef UPLOAD_H
 #define UPLOAD_H
 
+#include "LPC11xx.h"
+
+/**
+ * Set while there's a range of records the base station has asked for
+ * again that hasn't been uploaded yet.
+ */
+uint8_t reupload_active;
+
+void request_reupload(uint64_t from, uint64_t to);
+void upload_report(uint8_t seq, uint16_t history);
 void upload(void);
 
 #endif /* UPLOAD_H */
@@ -0,0 +1,58 @@
+/* 
+ * Host stand-in for the LPC11xx device header
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SIM_LPC11xx_H
+#define SIM_LPC11xx_H
+
+/**
+ * Use the real register layouts, but point the peripherals at plain
+ * memory so the firmware can poke them on the host. TMR32B1 and
+ * GPIO0 go through functions so the simulation can keep its time.
+ */
+#include "../chip/LPC11xx.h"
+
+extern LPC_SYSCON_TypeDef sim_syscon;
+extern LPC_IOCON_TypeDef sim_iocon;
+extern LPC_GPIO_TypeDef sim_gpio[4];
+extern LPC_CT32B1_TypeDef sim_ct32b1;
+LPC_CT32B1_TypeDef* sim_ct32b1_access(void);
+LPC_GPIO_TypeDef* sim_gpio0_access(void);
+
+#undef LPC_SYSCON
+#undef LPC_IOCON
+#undef LPC_GPIO0
+#undef LPC_GPIO1
+#undef LPC_GPIO2
+#undef LPC_GPIO3
+#undef LPC_CT32B1
+
+#define LPC_SYSCON	(&sim_syscon)
+#define LPC_IOCON	(&sim_iocon)
+#define LPC_GPIO0	(sim_gpio0_access())
+#define LPC_GPIO1	(&sim_gpio[1])
+#define LPC_GPIO2	(&sim_gpio[2])
+#define LPC_GPIO3	(&sim_gpio[3])
+#define LPC_CT32B1	(sim_ct32b1_access())
+
+#endif /* SIM_LPC11xx_H */
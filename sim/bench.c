@@ -0,0 +1,721 @@
+/* 
+ * Benchmarks the storage code against simulated flash chips
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "LPC11xx.h"
+#include "sst25.h"
+#include "hal.h"
+#include "mem/btree.h"
+#include "mem/checksum.h"
+#include "mem/flash.h"
+#include "mem/record.h"
+#include "mem/retention.h"
+#include "mem/scrub.h"
+#include "mem/wipe_mem.h"
+#include "mem/write.h"
+#include "dump.h"
+#include "radio/radio.h"
+#include "radio_callback.h"
+#include "rollup.h"
+#include "timing.h"
+#include "upload.h"
+
+/**
+ * Accumulates the cost of a run of operations.
+ */
+struct op_stats {
+  const char* name;
+  uint64_t count;
+  uint64_t ns, max_ns;
+  uint64_t spi_bytes, transactions;
+};
+
+static uint64_t op_start_ns;
+static struct sst25_stats op_start_stats;
+
+static void op_begin(void) {
+  op_start_ns = sim_now_ns;
+  op_start_stats = sim_stats;
+}
+static void op_end(struct op_stats* s) {
+  uint64_t ns = sim_now_ns - op_start_ns;
+
+  s->count++;
+  s->ns += ns;
+  if (ns > s->max_ns) { s->max_ns = ns; }
+  s->spi_bytes += sim_stats.spi_bytes - op_start_stats.spi_bytes;
+  s->transactions += sim_stats.transactions - op_start_stats.transactions;
+}
+static void op_print(struct op_stats* s) {
+  uint64_t n = s->count ? s->count : 1;
+
+  printf("  %-22s %8llu ops  %9.1f us/op  max %9.1f us  %7.1f SPI bytes/op  %5.1f txns/op\n",
+	 s->name, (unsigned long long)s->count, s->ns / 1000.0 / n,
+	 s->max_ns / 1000.0, (double)s->spi_bytes / n, (double)s->transactions / n);
+}
+static void print_violations(void) {
+  printf("  bus: %llu bytes, %llu transactions, %llu erases, %llu busy polls\n",
+	 (unsigned long long)sim_stats.spi_bytes, (unsigned long long)sim_stats.transactions,
+	 (unsigned long long)sim_stats.erases, (unsigned long long)sim_stats.busy_polls);
+  if (sim_stats.ignored_while_busy || sim_stats.ignored_no_wel ||
+      sim_stats.ignored_protected || sim_stats.ignored_in_aai) {
+    printf("  WARNING: busy %llu, no WEL %llu, protected %llu, in AAI %llu\n",
+	   (unsigned long long)sim_stats.ignored_while_busy,
+	   (unsigned long long)sim_stats.ignored_no_wel,
+	   (unsigned long long)sim_stats.ignored_protected,
+	   (unsigned long long)sim_stats.ignored_in_aai);
+  }
+}
+
+/* -------- Leaves -------- */
+
+/**
+ * Counts the leaves in each state by looking straight at the memory.
+ */
+static void count_leaves(uint8_t chip_count, uint32_t* valid, uint32_t* invalid, uint32_t* erased) {
+  uint8_t chip, branch; uint32_t tree, i;
+
+  *valid = *invalid = *erased = 0;
+  for (chip = 0; chip < chip_count; chip++) {
+    for (tree = 0; tree < sim_part->size; tree += 0x100000) {
+      uint8_t* mem = sim_flash_memory(chip) + tree;
+      for (branch = 1; branch < 16; branch++) {
+	for (i = 0; i < MAX_RECORDS_PER_BRANCH; i++) {
+	  uint8_t leaf = mem[(branch << 12) + i];
+	  if (leaf == 0xFF) { (*erased)++; }
+	  else if (leaf == 0x00) { (*invalid)++; }
+	  else { (*valid)++; }
+	}
+      }
+    }
+  }
+}
+
+/**
+ * Finds the span of times on the stored records, and how many are from
+ * between from and to, by reading every leaf.
+ */
+static uint32_t count_in_range(uint8_t chip_count, uint64_t from, uint64_t to,
+			       uint64_t* first, uint64_t* last) {
+  uint8_t chip, branch; uint32_t tree, i, count = 0;
+  uint64_t time;
+
+  *first = UINT64_MAX; *last = 0;
+  for (chip = 0; chip < chip_count; chip++) {
+    for (tree = 0; tree < sim_part->size; tree += 0x100000) {
+      uint8_t* mem = sim_flash_memory(chip) + tree;
+      for (branch = 1; branch < 16; branch++) {
+	for (i = 0; i < MAX_RECORDS_PER_BRANCH; i++) {
+	  uint8_t leaf = mem[(branch << 12) + i];
+	  if (leaf != 0x52 && leaf != 0x00) { continue; }
+	  time = read_record_time((chip << 24) | tree | (branch << 12) | i);
+	  if (time < *first) { *first = time; }
+	  if (time > *last) { *last = time; }
+	  if (time >= from && time <= to) { count++; }
+	}
+      }
+    }
+  }
+
+  return count;
+}
+
+/* -------- Workloads -------- */
+
+static uint32_t seconds = 0;
+extern uint32_t write_leaf_address;
+
+/**
+ * Logs like infinite_deep_sleep does: an em record every 64 seconds,
+ * a battery record every 10 minutes and the roll-ups. We time
+ * write_sample_to_mem on its own, and with the wait for the write that
+ * follows it.
+ */
+static void log_one(struct op_stats* s, struct op_stats* w) {
+  uint64_t start;
+  uint32_t i;
+
+  seconds += 64;
+  increment_us(64*1000*1000);
+  sim_deep_sleep_ns(64ULL*1000*1000*1000);
+  WaitForAutoWrite();
+
+  for (i = 0; i < 128; i++) {
+    rollup_reading((seconds + i) % 1000, (seconds * 7 + i) % 1000);
+  }
+
+  start = sim_now_ns;
+  op_begin();
+  write_sample_to_mem(0x5CE3 << 10 | 0xE3, seconds * 3, seconds * 5, 32);
+  op_end(s);
+  op_start_ns = start;
+  wait_for_write_complete();
+  op_end(w);
+
+  if (seconds % 640 < 64) {
+    start = sim_now_ns;
+    op_begin();
+    write_sample_to_mem(60 << 26, seconds & 0xFFFF, 0, 300);
+    op_end(s);
+    op_start_ns = start;
+    wait_for_write_complete();
+    op_end(w);
+  }
+
+  /* The end of the wake */
+  reclaim_ahead();
+}
+static void upload_one(struct op_stats* s) {
+  op_begin();
+  flush_writes();
+  wait_for_write_complete();
+  upload();
+  radio_sleep();
+  op_end(s);
+  reclaim_ahead();
+}
+/**
+ * Uploads until a few wakes in a row get nothing through, as a lossy
+ * link can lose the first frame of a wake.
+ */
+static void upload_all(struct op_stats* s) {
+  uint64_t before;
+  uint8_t idle = 0;
+
+  do {
+    before = base_stats.records;
+    sim_deep_sleep_ns(45ULL*1000*1000*1000);
+    upload_one(s);
+    idle = (base_stats.records == before) ? idle + 1 : 0;
+  } while (idle < 4 && s->count < 100000);
+}
+
+/**
+ * Cuts the power part way through a flush, then boots again like
+ * main() does. RAM doesn't survive, so neither does the branch header
+ * record.c keeps.
+ */
+static void power_cut_during_flush(uint8_t chip_count, uint64_t after_ns) {
+  uint32_t page;
+  uint8_t i;
+
+  for (i = 0; i < 3; i++) {
+    seconds += 64;
+    increment_us(64*1000*1000);
+    write_sample_to_mem(0x5CE3 << 10 | 0xE3, seconds * 3, seconds * 5, 32);
+  }
+  flush_writes();
+  sim_sleep_ns(after_ns);
+
+  sim_flash_power(0);
+  WaitForFlashQueue();
+  sim_flash_power(1);
+
+  for (page = 0; page < ((uint32_t)chip_count << 24); page += 0x10000) {
+    forget_branch_header(page);
+  }
+  flash_init();
+  /* Deselecting puts back the interrupt state from the last select,
+   * which a real reset would have cleared */
+  __set_PRIMASK(0);
+  flash_setup();
+  init_write();
+}
+static uint32_t count_reserved(uint8_t chip_count) {
+  uint32_t tree, i, reserved = 0;
+  uint8_t chip;
+
+  for (chip = 0; chip < chip_count; chip++) {
+    for (tree = 0; tree < sim_part->size; tree += 0x100000) {
+      uint8_t* mem = sim_flash_memory(chip) + tree;
+      for (i = 0x1000; i < 0x10000; i++) {
+	if (mem[i] == LEAF_RESERVED) { reserved++; }
+      }
+    }
+  }
+  return reserved;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-i image] [-c chips] [-p part] [-n records] [-s records] [-l loss%%] [-v]\n", name);
+  fprintf(stderr, "Parts: sst25wf080 (the default), w25q32, w25q128\n");
+  exit(1);
+}
+
+/**
+ * Prints the spread of erase counts over the root and branch sectors.
+ */
+static void print_wear(uint8_t chip_count) {
+  uint8_t chip, branch; uint32_t tree, branches = 0, roots = 0;
+  uint16_t count, low = 0xFFFF, high = 0, root_high = 0;
+  uint64_t total = 0;
+
+  for (chip = 0; chip < chip_count; chip++) {
+    for (tree = 0; tree < sim_part->size; tree += 0x100000) {
+      uint32_t address = ((uint32_t)chip << 24) | tree;
+      count = get_erase_count(address);
+      if (count == ERASE_COUNT_UNKNOWN) { count = 0; }
+      if (count > root_high) { root_high = count; }
+      roots++;
+      for (branch = 1; branch < 16; branch++) {
+	count = get_erase_count(address | (branch << 12));
+	if (count == ERASE_COUNT_UNKNOWN) { count = 0; }
+	if (count < low) { low = count; }
+	if (count > high) { high = count; }
+	total += count; branches++;
+      }
+    }
+  }
+
+  printf("Wear: branches erased %u to %u times, %.1f on average; roots at most %u times over %u trees\n",
+	 low, high, (double)total / branches, root_high, roots);
+}
+
+int main(int argc, char** argv) {
+  const char* image_path = NULL;
+  uint8_t chip_count = 3;
+  uint32_t extra = 2000, steady = 20000, valid, invalid, erased, capacity, i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:c:p:n:s:l:v")) != -1) {
+    switch (opt) {
+      case 'i': image_path = optarg; break;
+      case 'c': chip_count = atoi(optarg); break;
+      case 'p': if (!sim_flash_select_part(optarg)) { usage(argv[0]); } break;
+      case 'n': extra = atoi(optarg); break;
+      case 's': steady = atoi(optarg); break;
+      case 'l': sim_loss_percent = atoi(optarg); break;
+      case 'v': sim_verbose = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (chip_count < 1 || chip_count > SIM_MAX_CHIPS) { usage(argv[0]); }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  sim_flash_init(image_path, chip_count);
+
+  /* Boot like main() does */
+  struct op_stats boot = { .name = "boot" };
+  op_begin();
+  flash_init();
+  flash_setup();
+  init_write();
+  op_end(&boot);
+
+  /* Then wipe like do_wipe does, as an image might have something in it */
+  struct op_stats wipe = { .name = "wipe_mem" };
+  op_begin();
+  wipe_mem();
+  init_write();
+  op_end(&wipe);
+
+  radio_init(radio_rx_callback);
+  time_init();
+  struct time_64_t t = { .high = 0, .low = 1400000000, .us = 0, .valid = 0 };
+  set_time(t);
+
+  printf("Boot (%u %s chips)\n", chip_count, sim_part->name);
+  op_print(&boot);
+  op_print(&wipe);
+
+  /* Fill the memory until the oldest records start being decimated */
+  struct op_stats fill = { .name = "write_sample_to_mem" };
+  struct op_stats fill_wait = { .name = "  and wait" };
+  capacity = chip_count * (sim_part->size >> 20) * 15 * MAX_RECORDS_PER_BRANCH;
+  count_leaves(chip_count, &valid, &invalid, &erased);
+  sim_stats_reset();
+  do {
+    for (i = 0; i < 64 && i < erased; i++) { log_one(&fill, &fill_wait); }
+    flush_writes(); wait_for_write_complete();
+    count_leaves(chip_count, &valid, &invalid, &erased);
+  } while (erased > 0 && retention_decimations == 0 && fill.count < capacity + extra);
+  printf("\nFill to full: %u of %u leaves valid, %.1f days of logging\n",
+	 valid, capacity, seconds / 86400.0);
+  op_print(&fill);
+  op_print(&fill_wait);
+  print_violations();
+
+  /* Keep logging through an outage as long again as the memory lasts */
+  {
+    uint64_t first, last, start, wake_ns, max_wake_ns = 0;
+    uint32_t fill_seconds = seconds;
+    struct op_stats outage = { .name = "write_sample_to_mem" };
+    struct op_stats outage_wait = { .name = "  and wait" };
+
+    sim_stats_reset();
+    while (seconds < 2 * fill_seconds) {
+      start = sim_now_ns;
+      log_one(&outage, &outage_wait);
+      wake_ns = sim_now_ns - start - 64ULL*1000*1000*1000;
+      if (wake_ns > max_wake_ns) { max_wake_ns = wake_ns; }
+    }
+    flush_writes(); wait_for_write_complete();
+    count_leaves(chip_count, &valid, &invalid, &erased);
+    count_in_range(chip_count, 0, 0, &first, &last);
+    printf("\nOutage: %u valid leaves hold %.1f of %.1f days, %u decimations, %u dropped\n",
+	   valid, (last - first) / 86400.0, seconds / 86400.0,
+	   retention_decimations, retention_dropped);
+    op_print(&outage);
+    op_print(&outage_wait);
+    printf("  longest wake %.1f ms\n", max_wake_ns / 1e6);
+    print_violations();
+    if (last + 600 < 1400000000ULL + seconds) {
+      printf("WARNING: the newest records were lost\n");
+    }
+  }
+
+  /* Rot a few records, and check the scrubber finds them before upload */
+  {
+    struct op_stats scrubbing = { .name = "scrub" };
+    uint32_t leaf, rotted = 0, passes = scrub_passes;
+
+    while (rotted < 20) {
+      leaf = ((rand() % chip_count) << 24) | (rand() % (sim_part->size >> 20)) << 20 |
+	(1 + rand() % 15) << 12 | rand() % MAX_RECORDS_PER_BRANCH;
+      if (sim_flash_memory(leaf >> 24)[leaf & 0xFFFFFF] != 0x52) { continue; }
+      sim_flash_memory(leaf >> 24)[(leaf_addr_to_record_addr(leaf) & 0xFFFFFF) + 5] ^= 0x10;
+      rotted++;
+    }
+
+    sim_stats_reset();
+    while (scrub_passes == passes && scrubbing.count < 1000000) {
+      sim_deep_sleep_ns(10ULL*1000*1000*1000);
+      op_begin();
+      scrub();
+      op_end(&scrubbing);
+    }
+    flush_writes(); wait_for_write_complete(); WaitForFlashQueue();
+    printf("\nScrub: %u of %u rotted records found in %u records checked\n",
+	   scrub_records_corrupt, rotted, scrub_records_checked);
+    op_print(&scrubbing);
+    print_violations();
+    if (scrub_records_corrupt != rotted) {
+      printf("WARNING: the scrubber missed some rotted records\n");
+    }
+  }
+
+  /* Upload everything */
+  struct op_stats up = { .name = "upload" };
+  struct base_station_stats before_up = base_stats;
+  sim_stats_reset();
+  upload_all(&up);
+  count_leaves(chip_count, &valid, &invalid, &erased);
+  printf("\nUpload and invalidate: %llu records sent, %llu bad, %llu acked, %u still valid\n",
+	 (unsigned long long)base_stats.records, (unsigned long long)base_stats.bad_records,
+	 (unsigned long long)base_stats.acks, valid);
+  printf("  %llu frames up, %llu down, %.1f bytes over the air per record\n",
+	 (unsigned long long)(base_stats.frames - before_up.frames),
+	 (unsigned long long)(base_stats.ack_frames - before_up.ack_frames),
+	 (double)(base_stats.airtime_bytes - before_up.airtime_bytes) /
+	 (base_stats.records - before_up.records));
+  op_print(&up);
+  print_violations();
+
+  /* Keep logging so the write cursor wraps and reclaims branches */
+  struct op_stats wrap = { .name = "write_sample_to_mem" };
+  struct op_stats wrap_wait = { .name = "  and wait" };
+  sim_stats_reset();
+  for (i = 0; i < extra; i++) {
+    log_one(&wrap, &wrap_wait);
+  }
+  flush_writes(); wait_for_write_complete();
+  count_leaves(chip_count, &valid, &invalid, &erased);
+  printf("\nWraparound: %u valid, %u invalid, %u erased leaves\n", valid, invalid, erased);
+  op_print(&wrap);
+  op_print(&wrap_wait);
+  print_violations();
+
+  /* Set the clock back to a day before the branch we're writing to was
+   * started, as the base station can, and check the records still go
+   * on the same branch and read back intact */
+  {
+    struct time_64_t now = get_time(), back = now;
+    uint32_t skipped = write_leaves_skipped, leaf, full[FULL_RECORD_SIZE/4], bad = 0;
+    double days;
+
+    back.low = (uint32_t)read_record_time(write_leaf_address & 0xFFFFF000) - 86400;
+    days = (now.low - back.low) / 86400.0;
+    set_time(back);
+    for (i = 0; i < 16; i++) { log_one(&wrap, &wrap_wait); }
+    flush_writes(); wait_for_write_complete();
+    now.low += 16*64;
+    set_time(now);
+
+    for (leaf = write_leaf_address & 0xFFFFF000; leaf <= write_leaf_address; leaf++) {
+      if (get_leaf_status(leaf) != MEM_VALID) { continue; }
+      read_full_record(leaf, full);
+      if (evaluate_checksum((uint8_t*)full) == CHECKSUM_FAIL) { bad++; }
+    }
+    printf("\nClock set back %.1f days: %u leaves skipped, %u bad records on the branch\n",
+	   days, write_leaves_skipped - skipped, bad);
+    if (write_leaves_skipped != skipped || bad > 0) {
+      printf("WARNING: setting the clock back cost us leaves or records\n");
+    }
+  }
+
+  /* Log with an upload every ten minutes, so branches are erased as we go */
+  struct op_stats steady_w = { .name = "write_sample_to_mem" };
+  struct op_stats steady_ww = { .name = "  and wait" };
+  struct op_stats steady_up = { .name = "upload" };
+  sim_stats_reset();
+  for (i = 0; i < steady; i++) {
+    log_one(&steady_w, &steady_ww);
+    if (i % 10 == 9) { upload_one(&steady_up); }
+  }
+  flush_writes(); wait_for_write_complete();
+  count_leaves(chip_count, &valid, &invalid, &erased);
+  printf("\nSteady logging and upload: %u valid, %u invalid, %u erased leaves\n",
+	 valid, invalid, erased);
+  op_print(&steady_w);
+  op_print(&steady_ww);
+  op_print(&steady_up);
+  print_violations();
+  print_wear(chip_count);
+
+  /* Ask for a slice of what's still stored to be sent again */
+  {
+    struct op_stats ranged = { .name = "upload" };
+    uint64_t first, last, from, to, records;
+    uint8_t frame[17];
+    uint32_t expected;
+
+    do {
+      upload_all(&steady_up);
+      count_leaves(chip_count, &valid, &invalid, &erased);
+    } while (valid > 0);
+    count_in_range(chip_count, 0, 0, &first, &last);
+    from = first + (last - first) / 3;
+    to = first + 2 * (last - first) / 3;
+    expected = count_in_range(chip_count, from, to, &first, &last);
+
+    frame[0] = 'R';
+    for (i = 0; i < 8; i++) {
+      frame[1 + i] = from >> (8 * i);
+      frame[9 + i] = to >> (8 * i);
+    }
+    radio_rx_callback(frame, sizeof(frame), 0, BASE_STATION_ADDR);
+
+    sim_stats_reset();
+    records = base_stats.records;
+    while (reupload_active && ranged.count < 100000) {
+      sim_deep_sleep_ns(45ULL*1000*1000*1000);
+      op_begin();
+      upload();
+      radio_sleep();
+      op_end(&ranged);
+    }
+    /* And any of its frames that were lost on the way */
+    upload_all(&ranged);
+    printf("\nRanged re-upload: %llu of %u records in range received\n",
+	   (unsigned long long)(base_stats.records - records), expected);
+    op_print(&ranged);
+    print_violations();
+    /* A record can get through twice if its ack is lost */
+    if (base_stats.records - records < expected ||
+	(sim_loss_percent == 0 && base_stats.records - records != expected)) {
+      printf("WARNING: re-upload got the wrong number of records through\n");
+    }
+  }
+
+  /* Lose the base station for a day, then check the roll-ups come first */
+  {
+    struct op_stats catch_up = { .name = "upload" };
+    uint32_t loss = sim_loss_percent, rollups = 0, leaf, fine_first;
+    uint64_t records, rollups_before = base_stats.rollups;
+
+    sim_loss_percent = 100;
+    for (i = 0; i < 1350; i++) {
+      log_one(&steady_w, &steady_ww);
+      if (i % 10 == 9) { upload_one(&steady_up); }
+    }
+    sim_loss_percent = loss;
+    flush_writes(); wait_for_write_complete();
+
+    for (leaf = first_root(); next_record(&leaf, MEM_VALID, NO_WRAP) != 0xFFFFFFFF;) {
+      if (IS_ROLLUP_RECORD(read_record_flags(leaf))) { rollups++; }
+    }
+
+    sim_stats_reset();
+    records = base_stats.records;
+    while (base_stats.rollups - rollups_before < rollups && catch_up.count < 100000) {
+      sim_deep_sleep_ns(45ULL*1000*1000*1000);
+      upload_one(&catch_up);
+    }
+    fine_first = (base_stats.records - records) - (base_stats.rollups - rollups_before);
+    printf("\nCatch-up after an outage: %u roll-ups got through with %u other records\n",
+	   rollups, fine_first);
+    op_print(&catch_up);
+    print_violations();
+    if (fine_first >= 200) { /* Only what fits after the last of them */
+      printf("WARNING: the roll-ups didn't go first\n");
+    }
+    upload_all(&catch_up);
+  }
+
+  /* Log onto weak cells, and check nothing bad gets uploaded */
+  {
+    struct op_stats weak = { .name = "write_sample_to_mem" };
+    struct op_stats weak_wait = { .name = "  and wait" };
+    uint64_t bad = base_stats.bad_records;
+    uint32_t failures = verify_failures, passes;
+
+    sim_stats_reset();
+    sim_weak_cell_ppm = 2000;
+    for (i = 0; i < 2000; i++) {
+      log_one(&weak, &weak_wait);
+      if (i % 10 == 9) { upload_one(&steady_up); }
+    }
+    flush_writes(); wait_for_write_complete();
+    sim_weak_cell_ppm = 0;
+    upload_one(&steady_up);
+    bad = base_stats.bad_records - bad;
+
+    /* Anything bad is sent again and again until the scrubber finds it */
+    passes = scrub_passes;
+    while (scrub_passes < passes + 2) { scrub(); }
+    upload_all(&steady_up);
+    printf("\nWeak cells: %u records written again, %u given up on, %llu bad uploads\n",
+	   verify_failures - failures, verify_dropped, (unsigned long long)bad);
+    op_print(&weak);
+    op_print(&weak_wait);
+    print_violations();
+#ifdef VERIFY_WRITES
+    if (bad > 0) {
+      printf("WARNING: records that didn't write properly were uploaded\n");
+    }
+#endif
+  }
+
+  /* Dump all the memory over the radio, asking again for what's lost */
+  {
+    struct op_stats dumping = { .name = "dump" };
+    uint64_t frames = base_stats.frames, airtime = base_stats.airtime_bytes;
+    uint64_t requests = base_stats.dump_requests, bytes = base_stats.dump_bytes;
+    uint32_t size = chip_count * sim_part->size, differ = 0, loss = sim_loss_percent;
+    uint8_t chip;
+
+    sim_dump_image = calloc(size, 1);
+    sim_dump_chip_size = sim_part->size; sim_dump_chips = chip_count;
+    if (loss < 2) { sim_loss_percent = 2; }
+    sim_stats_reset();
+    sim_dump_start();
+    do {
+      while (dump_active) {
+	op_begin();
+	dump();
+	op_end(&dumping);
+      }
+    } while (sim_dump_next_request());
+    sim_loss_percent = loss;
+
+    for (chip = 0; chip < chip_count; chip++) {
+      uint8_t* mem = sim_flash_memory(chip);
+      for (i = 0; i < sim_part->size; i++) {
+	if (mem[i] != sim_dump_image[chip * sim_part->size + i]) { differ++; }
+      }
+    }
+    printf("\nBulk dump: %u of %u bytes differ, %llu frames and %llu requests, %.1f KBytes over the air\n",
+	   differ, size, (unsigned long long)(base_stats.frames - frames),
+	   (unsigned long long)(base_stats.dump_requests - requests),
+	   (base_stats.airtime_bytes - airtime) / 1024.0);
+    printf("  %.1f KBytes of the memory was erased or sent as data\n",
+	   (base_stats.dump_bytes - bytes) / 1024.0);
+    op_print(&dumping);
+    print_violations();
+    if (differ > 0) {
+      printf("WARNING: the dump doesn't match the memory\n");
+    }
+    free(sim_dump_image);
+    sim_dump_image = NULL;
+  }
+
+  /* Log while a branch on another chip is being erased */
+  if (chip_count > 1) {
+    struct op_stats cross = { .name = "write_sample_to_mem" };
+    struct op_stats cross_wait = { .name = "  and wait" };
+    uint64_t start;
+    sim_stats_reset();
+    for (i = 0; i < 200; i++) {
+      seconds += 64;
+      increment_us(64*1000*1000);
+      sim_deep_sleep_ns(64ULL*1000*1000*1000);
+      WaitForFlashQueue();
+      erase_branch(((((write_leaf_address >> 24) + 1) % chip_count) << 24) | 0xF000);
+      start = sim_now_ns;
+      op_begin();
+      write_sample_to_mem(0x5CE3 << 10 | 0xE3, seconds * 3, seconds * 5, 32);
+      op_end(&cross);
+      op_start_ns = start;
+      wait_for_write_complete();
+      op_end(&cross_wait);
+    }
+    flush_writes(); wait_for_write_complete(); WaitForFlashQueue();
+    printf("\nLogging during an erase on another chip\n");
+    op_print(&cross);
+    op_print(&cross_wait);
+    print_violations();
+  }
+
+  /* Lose power part way through flushes, and check nothing bad gets uploaded */
+  struct op_stats boot_cut = { .name = "boot" };
+  struct op_stats up_cut = { .name = "upload" };
+  uint64_t bad_before = base_stats.bad_records, records_before = base_stats.records;
+  uint32_t reserved = 0;
+  srand(1);
+  upload_all(&up_cut);
+  up_cut.count = up_cut.ns = up_cut.max_ns = up_cut.spi_bytes = up_cut.transactions = 0;
+  bad_before = base_stats.bad_records; records_before = base_stats.records;
+  sim_stats_reset();
+  for (i = 0; i < 200; i++) {
+    op_begin();
+    power_cut_during_flush(chip_count, (uint64_t)(rand() % 2500) * 1000);
+    op_end(&boot_cut);
+    reserved += count_reserved(chip_count);
+  }
+  upload_all(&up_cut);
+  printf("\nPower cuts during flushes: %u reserved leaves left after boot, %llu records sent, %llu bad\n",
+	 reserved, (unsigned long long)(base_stats.records - records_before),
+	 (unsigned long long)(base_stats.bad_records - bad_before));
+  op_print(&boot_cut);
+  print_violations();
+
+  /* Wipe what's left, which is mostly blank by now */
+  struct op_stats wipe_used = { .name = "wipe_mem" };
+  sim_stats_reset();
+  op_begin();
+  wipe_mem();
+  init_write();
+  op_end(&wipe_used);
+  count_leaves(chip_count, &valid, &invalid, &erased);
+  printf("\nWipe: %u valid, %u invalid, %u erased leaves\n", valid, invalid, erased);
+  op_print(&wipe_used);
+  print_violations();
+
+  sim_flash_close();
+  return 0;
+}
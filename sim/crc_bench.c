@@ -0,0 +1,102 @@
+/* 
+ * Times the CRC engine checksum.c was built with
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#include "LPC11xx.h"
+#include "mem/btree.h"
+#include "mem/checksum.h"
+
+/**
+ * The variant checksum.c was built with
+ */
+#if defined(CRC_SLICING_BY_4)
+#define ENGINE "slicing-by-4"
+#elif defined(CRC_BYTE_TABLE)
+#define ENGINE "byte table"
+#else
+#define ENGINE "nibble table"
+#endif
+
+enum {
+  BUFFER_SIZE	= 4096,
+  PASSES	= 20000,
+};
+
+uint8_t buffer[BUFFER_SIZE];
+
+static uint64_t cycles(void) {
+#ifdef __x86_64__
+  return __rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec; /* Nanoseconds will do */
+#endif
+}
+/**
+ * Checksums length bytes at a time until the whole buffer's been done
+ * PASSES times, and returns the bytes per cycle.
+ */
+static double time_crc(uint16_t length) {
+  volatile uint32_t sink = 0;
+  uint64_t start, end;
+  uint32_t pass, i;
+
+  start = cycles();
+  for (pass = 0; pass < PASSES; pass++) {
+    for (i = 0; i + length <= BUFFER_SIZE; i += length) {
+      sink ^= crc32_finish(crc32_update(crc32_start(), buffer + i, length));
+    }
+  }
+  end = cycles();
+
+  return (double)PASSES * (BUFFER_SIZE / length) * length / (end - start);
+}
+
+int main(int argc, char** argv) {
+  const uint8_t check[] = "123456789";
+  uint32_t crc, i;
+
+  for (i = 0; i < BUFFER_SIZE; i++) { buffer[i] = rand(); }
+
+  /* The standard check value, fed in a piece at a time */
+  crc = crc32_start();
+  crc = crc32_update(crc, check, 4);
+  crc = crc32_update(crc, check + 4, 5);
+  if (crc32_finish(crc) != 0xCBF43926) {
+    printf("WARNING: %s gets 0x%08X for the check value\n", ENGINE, crc32_finish(crc));
+  }
+
+  printf("%-14s %6s bytes ROM  %5.3f bytes/cycle for records  %5.3f bytes/cycle for %u byte blocks\n",
+	 ENGINE, argc > 1 ? argv[1] : "?", time_crc(FULL_RECORD_SIZE-4),
+	 time_crc(BUFFER_SIZE), BUFFER_SIZE);
+
+  return 0;
+}
@@ -0,0 +1,290 @@
+/* 
+ * Host stand-ins for the rest of the hardware
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "LPC11xx.h"
+#include "sst25.h"
+#include "hal.h"
+
+LPC_SYSCON_TypeDef sim_syscon;
+LPC_IOCON_TypeDef sim_iocon;
+LPC_GPIO_TypeDef sim_gpio[4];
+LPC_CT32B1_TypeDef sim_ct32b1;
+NVIC_Type sim_nvic;
+
+/**
+ * The clock the timers run from.
+ */
+uint32_t sim_cpu_hz = 12*1000*1000;
+uint8_t sim_verbose = 0;
+
+static uint8_t irq_enabled[32];
+/**
+ * PRIMASK, and how many interrupts deep we are.
+ */
+static uint32_t primask;
+static uint8_t isr_depth;
+/**
+ * TMR32B1 runs in simulated time from when we first see it started.
+ */
+static uint8_t timer_running;
+static uint64_t timer_due_ns;
+static uint64_t timer_start_ns;
+static uint32_t timer_start_tc;
+/**
+ * What IR should read as. It's write-one-to-clear on the hardware.
+ */
+static uint32_t timer_ir;
+
+/**
+ * P0[8], which carries SO from the flash.
+ */
+static uint8_t so_level = 1;
+static uint64_t so_ready_ns;
+static uint32_t gpio0_ris;
+
+void TIMER32_1_IRQHandler(void);
+/* Only there with FLASH_HARDWARE_BUSY */
+void PIOINT0_IRQHandler(void) __attribute__((weak));
+static uint8_t update_gpio0(void);
+
+/* -------- TMR32B1 -------- */
+
+/**
+ * Catches TMR32B1 up with the current time, and takes its interrupt
+ * if it can. Returns 1 if it did.
+ */
+static uint8_t update_timer_32_1(void) {
+  /* The firmware only ever writes IR to clear it */
+  if (sim_ct32b1.IR != timer_ir) { timer_ir = 0; }
+
+  if (sim_ct32b1.TCR & 0x2) { sim_ct32b1.TC = 0; } /* Held in reset */
+
+  if (!timer_running && (sim_ct32b1.TCR == 0x1)) { /* Just started */
+    uint64_t ticks = (uint64_t)(sim_ct32b1.PR + 1) * (sim_ct32b1.MR0 - sim_ct32b1.TC);
+    timer_running = 1;
+    timer_start_tc = sim_ct32b1.TC;
+    timer_start_ns = sim_now_ns;
+    timer_due_ns = sim_now_ns + ticks * 1000000000ULL / sim_cpu_hz;
+  } else if (timer_running && (sim_ct32b1.TCR != 0x1)) { /* Stopped */
+    timer_running = 0;
+  }
+
+  if (timer_running && sim_now_ns >= timer_due_ns) { /* Matched MR0 */
+    timer_running = 0;
+    sim_ct32b1.TCR = 0; /* Stop on match */
+    sim_ct32b1.TC = sim_ct32b1.MR0;
+    timer_ir |= 1;
+  } else if (timer_running) {
+    sim_ct32b1.TC = timer_start_tc + (sim_now_ns - timer_start_ns) * sim_cpu_hz /
+      1000000000ULL / (sim_ct32b1.PR + 1);
+  }
+  sim_ct32b1.IR = timer_ir;
+
+  if ((sim_ct32b1.IR & 1) && irq_enabled[TIMER_32_1_IRQn] &&
+      primask == 0 && isr_depth == 0) {
+    isr_depth++;
+    TIMER32_1_IRQHandler();
+    isr_depth--;
+    return 1;
+  }
+  return 0;
+}
+/**
+ * Each look at TMR32B1 takes a few cycles, so firmware that's spinning
+ * on it lets time pass until the match.
+ */
+LPC_CT32B1_TypeDef* sim_ct32b1_access(void) {
+  update_timer_32_1();
+  if (timer_running) {
+    sim_now_ns += SIM_REGISTER_NS;
+    update_timer_32_1();
+  }
+  return &sim_ct32b1;
+}
+/* -------- GPIO0 -------- */
+
+/**
+ * Follows SO on P0[8], latching rising edges and taking PIOINT0 if it
+ * can. Returns 1 if it did.
+ */
+static uint8_t update_gpio0(void) {
+  LPC_GPIO_TypeDef* port = &sim_gpio[0];
+  uint8_t level;
+
+  /* Writes to IC clear edges */
+  if (port->IC) { gpio0_ris &= ~port->IC; port->IC = 0; }
+
+  level = sim_flash_so(&so_ready_ns);
+  if (level && !so_level) { gpio0_ris |= (1 << 8); }
+  so_level = level;
+
+  port->MASKED_ACCESS[1 << 8] = level << 8;
+  *(uint32_t*)&port->RIS = gpio0_ris;
+  *(uint32_t*)&port->MIS = gpio0_ris & port->IE;
+
+  if (port->MIS && irq_enabled[PIOINT0_IRQn] && primask == 0 && isr_depth == 0 &&
+      PIOINT0_IRQHandler) {
+    isr_depth++;
+    PIOINT0_IRQHandler();
+    isr_depth--;
+    return 1;
+  }
+  return 0;
+}
+/**
+ * Once the firmware's waiting for an edge on SO it only looks at GPIO0
+ * to see if it's arrived, so we let time pass until it does.
+ */
+LPC_GPIO_TypeDef* sim_gpio0_access(void) {
+  update_gpio0();
+  if (so_level == 0 && (sim_gpio[0].IE & (1 << 8))) {
+    sim_now_ns = so_ready_ns;
+    sim_interrupts();
+  }
+  return &sim_gpio[0];
+}
+
+/**
+ * Called on every SPI byte so the timer starts when it should. An
+ * interrupt can start the timer or change SO, so we go round until
+ * neither has anything more to say.
+ */
+void sim_interrupts(void) {
+  while (update_timer_32_1() | update_gpio0());
+}
+/**
+ * Brackets code that would run in a higher priority interrupt on the
+ * real hardware.
+ */
+void sim_isr_enter(void) {
+  isr_depth++;
+}
+void sim_isr_exit(void) {
+  isr_depth--;
+  sim_interrupts();
+}
+/**
+ * Lets time pass with the processor asleep, taking any interrupts
+ * that come along.
+ */
+void sim_sleep_ns(uint64_t ns) {
+  uint64_t until = sim_now_ns + ns;
+
+  sim_interrupts();
+  while (1) {
+    uint64_t next = until;
+
+    if (timer_running && timer_due_ns < next) { next = timer_due_ns; }
+    if (so_level == 0 && so_ready_ns < next) { next = so_ready_ns; }
+    if (next <= sim_now_ns || next == until) { break; }
+
+    sim_now_ns = next;
+    sim_interrupts();
+  }
+  if (sim_now_ns < until) { sim_now_ns = until; }
+  sim_interrupts();
+}
+
+/**
+ * Deep sleep runs the processor from the watchdog oscillator, so
+ * TMR32B1 barely moves and nothing the flash does gets noticed until
+ * we're awake again.
+ */
+void sim_deep_sleep_ns(uint64_t ns) {
+  sim_interrupts();
+  if (timer_running) { timer_due_ns += ns; timer_start_ns += ns; }
+  sim_now_ns += ns;
+  sim_interrupts();
+}
+
+/* -------- NVIC -------- */
+
+void NVIC_EnableIRQ(IRQn_Type IRQn) {
+  if (IRQn < 0) { return; }
+  irq_enabled[IRQn] = 1;
+  sim_nvic.ISER[0] |= (1 << IRQn);
+  sim_interrupts();
+}
+void NVIC_DisableIRQ(IRQn_Type IRQn) {
+  if (IRQn >= 0) { irq_enabled[IRQn] = 0; sim_nvic.ISER[0] &= ~(1 << IRQn); }
+}
+void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority) {
+  (void)IRQn; (void)priority;
+}
+void NVIC_ClearPendingIRQ(IRQn_Type IRQn) {
+  (void)IRQn;
+}
+void NVIC_SetPendingIRQ(IRQn_Type IRQn) {
+  (void)IRQn;
+}
+void __disable_irq(void) {
+  primask = 1;
+}
+void __enable_irq(void) {
+  primask = 0;
+  sim_interrupts();
+}
+uint32_t __get_PRIMASK(void) {
+  return primask;
+}
+void __set_PRIMASK(uint32_t value) {
+  primask = value;
+  if (primask == 0) { sim_interrupts(); }
+}
+/**
+ * Non-zero while we're in an interrupt.
+ */
+uint32_t __get_IPSR(void) {
+  return isr_depth;
+}
+void __NOP(void) {}
+void __WFI(void) {
+  sim_run_until_idle();
+}
+
+/* -------- Console -------- */
+
+void _console_printf(const char *format, ...) {
+  if (sim_verbose) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
+}
+void _console_puts(const char *s) {
+  if (sim_verbose) { fprintf(stderr, "%s\n", s); }
+}
+int _console_putchar(char c) {
+  if (sim_verbose) { fputc(c, stderr); }
+  return 1;
+}
+void _console_flush(void) {}
+void _debug_putchar(char c) { (void)c; }
+void _debug_puts(const char* s) { (void)s; }
+void _debug_printf(const char *format, ...) { (void)format; }
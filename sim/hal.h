@@ -0,0 +1,67 @@
+/* 
+ * Host stand-ins for the rest of the hardware
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+/**
+ * How long a look at a peripheral register takes.
+ */
+#define SIM_REGISTER_NS	250
+
+extern uint32_t sim_cpu_hz;
+extern uint8_t sim_verbose;
+
+void sim_interrupts(void);
+void sim_isr_enter(void);
+void sim_isr_exit(void);
+void sim_sleep_ns(uint64_t ns);
+void sim_deep_sleep_ns(uint64_t ns);
+
+/**
+ * What the simulated base station saw.
+ */
+struct base_station_stats {
+  uint64_t frames;
+  uint64_t records;
+  uint64_t rollups;
+  uint64_t bad_records;
+  uint64_t acks;
+  uint64_t ack_frames;
+  uint64_t airtime_bytes;
+  uint64_t dump_bytes;
+  uint64_t dump_requests;
+};
+
+extern struct base_station_stats base_stats;
+extern uint32_t sim_loss_percent;
+extern uint8_t* sim_dump_image;
+extern uint32_t sim_dump_chip_size, sim_dump_chips;
+
+void sim_dump_start(void);
+uint8_t sim_dump_next_request(void);
+
+#endif /* HAL_H */
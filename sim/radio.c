@@ -0,0 +1,304 @@
+/* 
+ * A simulated radio link to a base station that acks every record
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "radio/radio.h"
+#include "hal.h"
+#include "rollup.h"
+
+/**
+ * Bytes that go over the air with each frame that aren't ours: the
+ * preamble, SFD, PHR, MAC header and FCS.
+ */
+#define FRAME_OVERHEAD	(4 + 1 + 1 + 9 + 2)
+
+struct base_station_stats base_stats;
+uint32_t sim_loss_percent = 0;
+
+/**
+ * Where the base station puts a memory dump, sim_dump_chip_size bytes
+ * for each chip.
+ */
+uint8_t* sim_dump_image;
+uint32_t sim_dump_chip_size, sim_dump_chips;
+
+/**
+ * The ranges of a dump that went missing, to ask for again
+ */
+#define DUMP_GAPS	4096
+static struct { uint32_t from, to; } dump_gaps[DUMP_GAPS];
+static uint32_t dump_gap_count;
+static uint32_t dump_next, dump_end;
+static uint8_t dump_ended;
+
+static rx_callback_func rx_callback;
+static uint16_t trac_status = TRAC_SUCCESS;
+static uint8_t ack_frame[128];
+
+/**
+ * The frame that's on the air. As on the radio, what became of it
+ * isn't known until the transmission's over, which is the next time
+ * the radio's used.
+ */
+static uint8_t tx_frame[128], tx_length, tx_in_progress;
+
+static uint32_t crc32(const uint8_t* data, uint32_t len) {
+  uint32_t crc = ~0U, i; uint8_t bit;
+
+  for (i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+static uint32_t get_u32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static void put_u32(uint8_t* p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+/**
+ * The base station checks each record it gets. Returns 1 if it's good.
+ */
+static uint8_t base_station_record(const uint8_t* record) {
+  base_stats.records++;
+
+  if (crc32(record, 20) != get_u32(record + 20)) {
+    base_stats.bad_records++; return 0;
+  }
+  if (IS_ROLLUP_RECORD(get_u32(record))) { base_stats.rollups++; }
+  base_stats.acks++;
+  return 1;
+}
+/**
+ * Sends an ack frame to the node.
+ */
+static void base_station_ack(uint8_t length) {
+  base_stats.ack_frames++;
+  base_stats.airtime_bytes += length + FRAME_OVERHEAD;
+
+  /* Acks get lost on the way down as often as frames on the way up */
+  if ((uint32_t)(rand() % 100) < sim_loss_percent) { return; }
+
+  /* This arrives in the radio interrupt */
+  sim_isr_enter();
+  rx_callback(ack_frame, length, 0, BASE_STATION_ADDR);
+  sim_isr_exit();
+}
+/**
+ * A single record is acked with its leaf and checksum.
+ */
+static void base_station_single(uint32_t leaf, const uint8_t* record) {
+  if (!base_station_record(record)) { return; }
+
+  ack_frame[0] = 'A';
+  put_u32(ack_frame + 1, leaf);
+  memcpy(ack_frame + 5, record + 20, 4);
+  base_station_ack(9);
+}
+/**
+ * The base station keeps track of the newest upload frame it has, and
+ * which of the 16 before that it has too.
+ */
+static uint8_t upload_seq, upload_seen;
+static uint16_t upload_history;
+
+static void base_station_sequence(uint8_t seq) {
+  uint8_t d = seq - upload_seq;
+
+  if (!upload_seen || (d > 128 && (uint8_t)(upload_seq - seq) > 16)) {
+    /* The first we've heard, or the node's started again */
+    upload_seq = seq; upload_history = 0; upload_seen = 1;
+  } else if (d > 0 && d <= 128) { /* Newer */
+    upload_history = (d > 16) ? 0 : (uint16_t)((upload_history << d) | (1 << (d - 1)));
+    upload_seq = seq;
+  } else if (d > 128) { /* Older, sent again */
+    upload_history |= 1 << ((uint8_t)(upload_seq - seq) - 1);
+  }
+}
+/**
+ * The good records in a 'P' frame are acked together, with a bitmap
+ * of their leaves and the sum of their checksums. The ack also reports
+ * which frames we have, so the node can send the missing ones again.
+ */
+static void base_station_packed(const uint8_t* data, uint8_t length) {
+  uint32_t leaf = get_u32(data + 2), sum = 0;
+  uint8_t bit, index = 7, bitmap = 0;
+
+  base_station_sequence(data[1]);
+
+  for (bit = 0; bit < 8 && index + 24 <= length; bit++) {
+    if (data[6] & (1 << bit)) {
+      if (base_station_record(data + index)) {
+	bitmap |= 1 << bit;
+	sum += get_u32(data + index + 20);
+      }
+      index += 24;
+    }
+  }
+
+  ack_frame[0] = 'K';
+  put_u32(ack_frame + 1, leaf);
+  ack_frame[5] = bitmap;
+  put_u32(ack_frame + 6, sum);
+  ack_frame[10] = upload_seq;
+  ack_frame[11] = upload_history;
+  ack_frame[12] = upload_history >> 8;
+  base_station_ack(13);
+}
+
+/**
+ * The base station copies each part of a dump into its image, and
+ * notes where frames are missing.
+ */
+static void base_station_dump(const uint8_t* data, uint8_t length) {
+  uint32_t address = get_u32(data + 1), size = 0, chip, offset;
+
+  if (address > dump_next && dump_gap_count < DUMP_GAPS) {
+    dump_gaps[dump_gap_count].from = dump_next;
+    dump_gaps[dump_gap_count].to = address;
+    dump_gap_count++;
+  }
+
+  if (data[0] == 'E') {
+    dump_ended = 1;
+    return;
+  }
+  size = (data[0] == 'M') ? (uint32_t)length - 5 : get_u32(data + 5);
+  base_stats.dump_bytes += size;
+
+  chip = address >> 24; offset = address & 0x00FFFFFF;
+  if (chip < sim_dump_chips && offset + size <= sim_dump_chip_size) {
+    uint8_t* to = sim_dump_image + chip * sim_dump_chip_size + offset;
+    if (data[0] == 'M') {
+      memcpy(to, data + 5, size);
+    } else {
+      memset(to, 0xFF, size);
+    }
+  }
+  dump_next = address + size;
+}
+/**
+ * Asks the node for the memory between from and to.
+ */
+static void base_station_request_dump(uint32_t from, uint32_t to) {
+  uint8_t frame[9];
+
+  frame[0] = 'B';
+  put_u32(frame + 1, from);
+  put_u32(frame + 5, to);
+  dump_next = from;
+  dump_end = to;
+  dump_ended = 0;
+  base_stats.dump_requests++;
+  base_stats.airtime_bytes += 9 + FRAME_OVERHEAD;
+  sim_isr_enter();
+  rx_callback(frame, 9, 0, BASE_STATION_ADDR);
+  sim_isr_exit();
+}
+/**
+ * The transmission's over. The base station deals with the frame, and
+ * any reply arrives in the radio interrupt.
+ */
+static void sim_tx_end(void) {
+  if (!tx_in_progress) { return; }
+  tx_in_progress = 0;
+
+  if ((uint32_t)(rand() % 100) < sim_loss_percent) {
+    trac_status = TRAC_NO_ACK; return;
+  }
+  trac_status = TRAC_SUCCESS;
+
+  if (tx_frame[0] == 'U' && tx_length >= 5 + 24) {
+    base_station_single(get_u32(tx_frame + 1), tx_frame + 5);
+  }
+  if (tx_frame[0] == 'P' && tx_length >= 7) {
+    base_station_packed(tx_frame, tx_length);
+  }
+  if ((tx_frame[0] == 'M' && tx_length > 5) || (tx_frame[0] == 'N' && tx_length >= 9) ||
+      (tx_frame[0] == 'E' && tx_length >= 5)) {
+    base_station_dump(tx_frame, tx_length);
+  }
+}
+/**
+ * Starts a dump of all the memory.
+ */
+void sim_dump_start(void) {
+  dump_gap_count = 0;
+  base_station_request_dump(0, 0xFFFFFFFF);
+}
+/**
+ * Once the node's finished sending, asks for the next range that went
+ * missing. If the end never arrived, that's everything after the last
+ * frame we got. Returns 0 if there's nothing missing.
+ */
+uint8_t sim_dump_next_request(void) {
+  sim_tx_end();
+
+  if (!dump_ended) {
+    base_station_request_dump(dump_next, dump_end);
+    return 1;
+  }
+  if (dump_gap_count > 0) {
+    dump_gap_count--;
+    base_station_request_dump(dump_gaps[dump_gap_count].from,
+			      dump_gaps[dump_gap_count].to);
+    return 1;
+  }
+  return 0;
+}
+
+void radio_init(rx_callback_func callback) {
+  rx_callback = callback;
+}
+void radio_transmit(uint8_t* data, uint8_t length, uint16_t destination,
+		    uint8_t ack) {
+  (void)destination; (void)ack;
+
+  /* The last frame has to finish first */
+  sim_tx_end();
+
+  base_stats.frames++;
+  base_stats.airtime_bytes += length + FRAME_OVERHEAD;
+
+  memcpy(tx_frame, data, length);
+  tx_length = length;
+  tx_in_progress = 1;
+}
+void radio_sleep(void) {
+  sim_tx_end();
+}
+void radio_wake(void) {}
+uint16_t radio_get_trac_status(void) {
+  return trac_status;
+}
+uint16_t radio_wait_for_tx_end(void) {
+  sim_tx_end();
+  return trac_status;
+}
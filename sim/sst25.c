@@ -0,0 +1,542 @@
+/* 
+ * Simulates SPI NOR flash chips on the SPI bus
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "LPC11xx.h"
+#include "sst25.h"
+#include "hal.h"
+#include "spi.h"
+#include "mem/btree.h"
+
+/**
+ * The status register bits.
+ */
+enum {
+  STATUS_BUSY	= 0x01,
+  STATUS_WEL	= 0x02,
+  STATUS_BP	= 0x1C,
+  STATUS_AAI	= 0x40,
+  STATUS_BPL	= 0x80,
+};
+
+struct sst25 {
+  uint8_t* mem;
+  uint8_t present;
+  uint8_t status;
+  uint64_t busy_until;
+  uint32_t aai_addr;
+  uint8_t busy_output;
+
+  /* The transaction that's in progress */
+  uint8_t selected;
+  uint32_t pos;
+  uint8_t cmd;
+  uint32_t addr;
+  uint8_t data[256];
+};
+
+/**
+ * The SST25WF080 fitted to the board. Busy times are the datasheet
+ * maximums.
+ */
+static const struct sim_part sst25wf080 = {
+  .name = "sst25wf080", .size = 0x100000,
+  .id = { 0xBF, 0x05 }, .jedec = { 0xBF, 0x25, 0x05 },
+  .page_size = 0, .sfdp = NULL,
+  .timing = {
+    .byte_program	= 40*1000,
+    .aai_program	= 40*1000,
+    .sector_erase	= 30*1000*1000,
+    .block_erase	= 30*1000*1000,
+    .chip_erase		= 60*1000*1000,
+    .spi_byte		= 1333,		/* 6MHz SCK */
+    .chip_select	= 500,
+  },
+};
+/**
+ * The JESD216 basic parameter table of a W25Q-style part: 4 KByte, 32
+ * KByte and 64 KByte erases, 256 byte pages programmed in 704us and a
+ * 4 KByte erase in 48ms. Only the density differs between sizes.
+ */
+#define W25Q_SFDP(density) {						\
+    0xFFF120E5, (density), 0x6B08EB44, 0x3B42BB08, 0xFFFFFFEE,		\
+    0xFF00FFFF, 0xEB40FFFF, 0x520F200C, 0x0000D810,			\
+    (0x1 << 23) | (9 << 18) | (0x2 << 16) | (0x1 << 9) | (2 << 4) | 0x2, \
+    (0x2 << 29) | (9 << 24) | (1 << 13) | (10 << 8) | (8 << 4) | 0x2, \
+  }
+static const uint32_t w25q32_sfdp[] = W25Q_SFDP(0x01FFFFFF);
+static const uint32_t w25q128_sfdp[] = W25Q_SFDP(0x07FFFFFF);
+/**
+ * Busy times are the datasheet typicals.
+ */
+#define W25Q_TIMING {				\
+    .byte_program	= 30*1000,		\
+    .page_program	= 700*1000,		\
+    .sector_erase	= 45*1000*1000,		\
+    .block_erase	= 150*1000*1000,	\
+    .chip_erase		= 10ULL*1000*1000*1000,	\
+    .spi_byte		= 1333,			\
+    .chip_select	= 500,			\
+  }
+static const struct sim_part w25q32 = {
+  .name = "w25q32", .size = 0x400000,
+  .id = { 0x15, 0x15 }, .jedec = { 0xEF, 0x40, 0x16 },
+  .page_size = 256, .sfdp = w25q32_sfdp, .timing = W25Q_TIMING,
+};
+static const struct sim_part w25q128 = {
+  .name = "w25q128", .size = 0x1000000,
+  .id = { 0x17, 0x17 }, .jedec = { 0xEF, 0x40, 0x18 },
+  .page_size = 256, .sfdp = w25q128_sfdp, .timing = W25Q_TIMING,
+};
+static const struct sim_part* const parts[] = { &sst25wf080, &w25q32, &w25q128 };
+
+const struct sim_part* sim_part = &sst25wf080;
+struct sst25_timing sim_timing;
+struct sst25_stats sim_stats;
+uint8_t sim_flash_powered = 1;
+uint32_t sim_weak_cell_ppm = 0;
+uint64_t sim_now_ns;
+
+static struct sst25 chips[SIM_MAX_CHIPS];
+static uint8_t* image; static size_t image_size;
+
+/**
+ * The receive FIFO the firmware reads back from.
+ */
+static uint8_t rx_fifo[256];
+static uint8_t rx_head, rx_tail;
+
+/**
+ * Which GPIO each chip select is on. These match flash_sockets.
+ */
+static const struct { uint8_t port; uint8_t pin; } chip_select_lines[SIM_MAX_CHIPS] = {
+  { 1, 7 }, { 2, 0 }, { 1, 8 },
+};
+
+/**
+ * The SFDP tables as the chip returns them.
+ */
+static uint8_t sfdp[0x100];
+
+/* -------- Image -------- */
+
+/**
+ * Picks the part that's fitted to every socket. Returns 0 if there's
+ * no such part.
+ */
+uint8_t sim_flash_select_part(const char* name) {
+  uint8_t i;
+
+  for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    if (strcmp(parts[i]->name, name) == 0) {
+      sim_part = parts[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+static void build_sfdp(void) {
+  uint8_t i;
+
+  memset(sfdp, 0xFF, sizeof(sfdp));
+  if (sim_part->sfdp == NULL) { return; }
+
+  /* Header: the signature, revision 1.5 and one parameter header */
+  memcpy(sfdp, "SFDP", 4);
+  sfdp[4] = 0x05; sfdp[5] = 0x01; sfdp[6] = 0x00;
+  /* The first 11 DWORDs of the basic parameter table are at 0x80 */
+  sfdp[8] = 0x00; sfdp[9] = 0x05; sfdp[10] = 0x01; sfdp[11] = 11;
+  sfdp[12] = 0x80; sfdp[13] = 0x00; sfdp[14] = 0x00; sfdp[15] = 0xFF;
+  for (i = 0; i < 11; i++) {
+    sfdp[0x80 + i*4 + 0] = sim_part->sfdp[i];
+    sfdp[0x80 + i*4 + 1] = sim_part->sfdp[i] >> 8;
+    sfdp[0x80 + i*4 + 2] = sim_part->sfdp[i] >> 16;
+    sfdp[0x80 + i*4 + 3] = sim_part->sfdp[i] >> 24;
+  }
+}
+void sim_flash_init(const char* image_path, uint8_t chip_count) {
+  uint8_t i;
+
+  sim_timing = sim_part->timing;
+  build_sfdp();
+  image_size = (size_t)SIM_MAX_CHIPS * sim_part->size;
+
+  if (image_path) {
+    int fd = open(image_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) { perror(image_path); exit(1); }
+    off_t len = lseek(fd, 0, SEEK_END);
+    if (ftruncate(fd, image_size) < 0) { perror(image_path); exit(1); }
+    image = mmap(NULL, image_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) { perror("mmap"); exit(1); }
+    /* A new image starts erased */
+    if ((size_t)len < image_size) { memset(image + len, 0xFF, image_size - len); }
+  } else {
+    image = mmap(NULL, image_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED) { perror("mmap"); exit(1); }
+    memset(image, 0xFF, image_size);
+  }
+
+  memset(chips, 0, sizeof(chips));
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    chips[i].mem = image + (size_t)i * sim_part->size;
+    chips[i].present = (i < chip_count);
+    chips[i].status = STATUS_BP; /* Powers up write protected */
+  }
+
+  /* All the GPIOs start high */
+  for (i = 0; i < 4; i++) {
+    memset((void*)sim_gpio[i].MASKED_ACCESS, 0xFF, sizeof(sim_gpio[i].MASKED_ACCESS));
+  }
+
+  rx_head = rx_tail = 0;
+  sim_now_ns = 0;
+  sim_stats_reset();
+}
+void sim_flash_close(void) {
+  munmap(image, image_size);
+}
+uint8_t* sim_flash_memory(uint8_t chip) {
+  return chips[chip].mem;
+}
+/**
+ * Takes the power away from the chips, or gives it back. While it's
+ * off they ignore everything and never look busy, so the firmware can
+ * run its queue dry. They come back write protected and idle.
+ */
+void sim_flash_power(uint8_t on) {
+  uint8_t i;
+
+  sim_flash_powered = on;
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    chips[i].status = STATUS_BP;
+    chips[i].busy_until = 0;
+    chips[i].busy_output = 0;
+    chips[i].selected = 0;
+  }
+}
+void sim_stats_reset(void) {
+  memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+/* -------- Time -------- */
+
+void sim_advance_ns(uint64_t ns) {
+  sim_now_ns += ns;
+}
+uint8_t sim_flash_busy(uint8_t chip) {
+  return chips[chip].busy_until > sim_now_ns;
+}
+/**
+ * The level on SO while nothing's being clocked. A selected chip
+ * drives RY/BY# during an automatic write if it's been told to, and
+ * the pull-up wins otherwise. When it's low, ready_ns is when it'll
+ * go high.
+ */
+uint8_t sim_flash_so(uint64_t* ready_ns) {
+  uint8_t i;
+
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    LPC_GPIO_TypeDef* port = &sim_gpio[chip_select_lines[i].port];
+    struct sst25* c = &chips[i];
+
+    if (port->MASKED_ACCESS[1 << chip_select_lines[i].pin] == 0 && c->present &&
+	c->busy_output && (c->status & STATUS_AAI) && c->busy_until > sim_now_ns) {
+      *ready_ns = c->busy_until;
+      return 0;
+    }
+  }
+  return 1;
+}
+/**
+ * Lets time pass until every chip has finished what it's doing.
+ */
+void sim_run_until_idle(void) {
+  uint8_t i;
+
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    if (chips[i].busy_until > sim_now_ns) { sim_now_ns = chips[i].busy_until; }
+  }
+}
+
+/* -------- Chip -------- */
+
+static uint8_t in_reset(void) {
+  /* The active-low reset is on P0[3] */
+  return sim_gpio[0].MASKED_ACCESS[1<<3] == 0;
+}
+static uint8_t status(struct sst25* c) {
+  uint8_t s = c->status & ~STATUS_BUSY;
+  if (c->busy_until > sim_now_ns) { s |= STATUS_BUSY; }
+  return s;
+}
+static void program(struct sst25* c, uint32_t addr, uint8_t value) {
+  addr %= sim_part->size;
+  /* A weak cell in a record doesn't take one of its zeros */
+  if (sim_weak_cell_ppm && (addr & 0x000F0000) && (addr & 0xFFFF) >= BRANCH_HEADER_SIZE &&
+      (uint32_t)(rand() % 1000000) < sim_weak_cell_ppm) {
+    value |= 1 << (rand() % 8);
+  }
+  c->mem[addr] &= value;
+  sim_stats.bytes_programmed++;
+}
+static void erase(struct sst25* c, uint32_t addr, uint32_t size, uint64_t t) {
+  addr = (addr % sim_part->size) & ~(size - 1);
+  memset(c->mem + addr, 0xFF, size);
+  c->busy_until = sim_now_ns + t;
+  sim_stats.erases++;
+}
+/**
+ * Checks that a program or erase is allowed, and clears WEL.
+ */
+static uint8_t write_allowed(struct sst25* c) {
+  if ((c->status & STATUS_WEL) == 0) {
+    sim_stats.ignored_no_wel++; return 0;
+  }
+  c->status &= ~STATUS_WEL;
+  if (c->status & STATUS_BP) {
+    sim_stats.ignored_protected++; return 0;
+  }
+  return 1;
+}
+/**
+ * Called for every byte clocked out while the chip is selected.
+ */
+static uint8_t chip_byte(struct sst25* c, uint8_t mosi) {
+  uint32_t pos = c->pos++;
+
+  if (pos == 0) { c->cmd = mosi; c->addr = 0; }
+  else if (pos <= 3) { c->addr = (c->addr << 8) | mosi; }
+  if (pos >= 4 && pos - 4 < sizeof(c->data)) { c->data[pos-4] = mosi; }
+
+  switch (c->cmd) {
+    case 0x03:			/* Read */
+      if (pos >= 4) { return c->mem[(c->addr + pos - 4) % sim_part->size]; }
+      break;
+    case 0x0B:			/* Speed Read */
+      if (pos >= 5) { return c->mem[(c->addr + pos - 5) % sim_part->size]; }
+      break;
+    case 0x5A:			/* Read SFDP */
+      if (pos >= 5) { return sfdp[(c->addr + pos - 5) & 0xFF]; }
+      break;
+    case 0x90: case 0xAB:	/* Read ID */
+      if (pos >= 4) { return sim_part->id[(c->addr ^ (pos - 4)) & 1]; }
+      break;
+    case 0x9F:			/* JEDEC ID */
+      if (pos >= 1 && pos <= 3) { return sim_part->jedec[pos - 1]; }
+      break;
+    case 0x05:			/* Read Status */
+      if (pos >= 1) { sim_stats.busy_polls++; return status(c); }
+      break;
+    default: break;
+  }
+
+  return 0xFF;
+}
+/**
+ * Called when the chip select goes high at the end of a transaction.
+ */
+static void chip_end(struct sst25* c) {
+  uint8_t cmd = c->cmd, busy = (c->busy_until > sim_now_ns);
+  uint32_t len = c->pos;
+
+  c->pos = 0;
+  if (len == 0) { return; }
+
+  sim_stats.transactions++;
+  sim_stats.commands[cmd]++;
+
+  /* Reads don't change anything */
+  if (cmd == 0x03 || cmd == 0x0B || cmd == 0x05 || cmd == 0x90 ||
+      cmd == 0xAB || cmd == 0x9F || cmd == 0x5A) {
+    return;
+  }
+  /* Otherwise the chip must be idle */
+  if (busy) {
+    sim_stats.ignored_while_busy++; return;
+  }
+  /* And only some commands work in AAI mode */
+  if ((c->status & STATUS_AAI) && cmd != 0xAD && cmd != 0x04) {
+    sim_stats.ignored_in_aai++; return;
+  }
+
+  switch (cmd) {
+    case 0x06:			/* Write Enable */
+      c->status |= STATUS_WEL;
+      break;
+    case 0x04:			/* Write Disable */
+      c->status &= ~(STATUS_WEL | STATUS_AAI);
+      break;
+    case 0x50:			/* Enable Write Status */
+      c->status |= STATUS_WEL;
+      break;
+    case 0x01:			/* Write Status */
+      if (len < 2) { break; }
+      if ((c->status & STATUS_WEL) == 0) { sim_stats.ignored_no_wel++; break; }
+      c->status &= ~STATUS_WEL;
+      if (c->status & STATUS_BPL) { break; } /* Locked until reset */
+      c->status = (c->status & (STATUS_WEL | STATUS_AAI)) |
+	(c->addr & (STATUS_BP | STATUS_BPL));
+      break;
+    case 0x02:			/* Byte Program, or Page Program */
+      if (len < 5 || !write_allowed(c)) { break; }
+      if (sim_part->page_size) { /* Wraps around within the page */
+	uint32_t i, page = c->addr & ~(uint32_t)(sim_part->page_size - 1);
+	for (i = 0; i < len - 4 && i < sizeof(c->data); i++) {
+	  program(c, page | ((c->addr + i) & (sim_part->page_size - 1)), c->data[i]);
+	}
+	c->busy_until = sim_now_ns + (len > 5 ? sim_timing.page_program : sim_timing.byte_program);
+      } else {
+	program(c, c->addr, c->data[0]);
+	c->busy_until = sim_now_ns + sim_timing.byte_program;
+      }
+      break;
+    case 0xAD:			/* Auto Address Increment Program */
+      if (sim_part->page_size) { break; } /* Not on this part */
+      if (c->status & STATUS_AAI) {
+	if (len < 3) { break; }
+	/* The data follows straight after the command */
+	program(c, c->aai_addr, (c->addr >> 8) & 0xFF);
+	program(c, c->aai_addr+1, c->addr & 0xFF);
+	c->aai_addr += 2;
+      } else {
+	if (len < 6 || !write_allowed(c)) { break; }
+	c->status |= STATUS_AAI | STATUS_WEL;
+	c->aai_addr = c->addr & ~1;
+	program(c, c->aai_addr, c->data[0]);
+	program(c, c->aai_addr+1, c->data[1]);
+	c->aai_addr += 2;
+      }
+      c->busy_until = sim_now_ns + sim_timing.aai_program;
+      break;
+    case 0x20:			/* 4 KByte Sector Erase */
+      if (len < 4 || !write_allowed(c)) { break; }
+      erase(c, c->addr, 0x1000, sim_timing.sector_erase);
+      break;
+    case 0x52:			/* 32 KByte Block Erase */
+      if (len < 4 || !write_allowed(c)) { break; }
+      erase(c, c->addr, 0x8000, sim_timing.block_erase);
+      break;
+    case 0xD8:			/* 64 KByte Block Erase */
+      if (len < 4 || !write_allowed(c)) { break; }
+      erase(c, c->addr, 0x10000, sim_timing.block_erase);
+      break;
+    case 0x60: case 0xC7:	/* Chip Erase */
+      if (!write_allowed(c)) { break; }
+      erase(c, 0, sim_part->size, sim_timing.chip_erase);
+      break;
+    case 0x70:			/* Enable SO as busy output */
+      if (sim_part->page_size) { break; } /* Not on this part */
+      c->busy_output = 1;
+      break;
+    case 0x80:			/* Disable SO as busy output */
+      c->busy_output = 0;
+      break;
+    default: break;
+  }
+}
+
+/* -------- SPI -------- */
+
+/**
+ * Returns the chip that currently has its chip select low, if any.
+ */
+static struct sst25* selected_chip(void) {
+  uint8_t i;
+
+  if (!sim_flash_powered) { return NULL; }
+
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    LPC_GPIO_TypeDef* port = &sim_gpio[chip_select_lines[i].port];
+    if (port->MASKED_ACCESS[1 << chip_select_lines[i].pin] == 0) {
+      return chips[i].present ? &chips[i] : NULL;
+    }
+  }
+  return NULL;
+}
+static void rx_push(uint8_t value) {
+  rx_fifo[rx_head++] = value;
+}
+
+void spi_write(uint16_t data) {
+  struct sst25* c = selected_chip();
+
+  sim_interrupts();
+
+  sim_now_ns += sim_timing.spi_byte;
+  sim_stats.spi_bytes++;
+
+  if (c && !in_reset()) {
+    if (!c->selected) { c->selected = 1; c->pos = 0; sim_now_ns += sim_timing.chip_select; }
+    rx_push(chip_byte(c, data & 0xFF));
+  } else {
+    /* Nothing drives SO. Unpowered chips read as zeros, so never look busy */
+    rx_push(sim_flash_powered ? 0xFF : 0x00);
+  }
+}
+uint16_t spi_read(void) {
+  if (rx_head == rx_tail) {
+    fprintf(stderr, "sim: spi_read with an empty RxFIFO\n"); abort();
+  }
+  return rx_fifo[rx_tail++];
+}
+uint8_t spi_xfer(uint8_t data) {
+  spi_write(data);
+  return spi_read();
+}
+uint16_t spi_xfer_16(uint16_t data) {
+  return spi_xfer(data);
+}
+void spi_dump_bytes(uint32_t dumpCount) {
+  while (dumpCount-- > 0) {
+    spi_read();
+  }
+}
+void spi_flush(void) {
+  rx_head = rx_tail = 0;
+}
+void general_spi_init(void) {}
+void flash_spi_init(void) {}
+void wm8737_spi_init(void) {}
+void spi_shutdown(void) {}
+/**
+ * ChipSelectFlash calls this just after it raises a chip select.
+ */
+void radio_spi_init(void) {
+  uint8_t i;
+
+  for (i = 0; i < SIM_MAX_CHIPS; i++) {
+    LPC_GPIO_TypeDef* port = &sim_gpio[chip_select_lines[i].port];
+    if (chips[i].selected && port->MASKED_ACCESS[1 << chip_select_lines[i].pin] != 0) {
+      chips[i].selected = 0;
+      chip_end(&chips[i]);
+    }
+  }
+}
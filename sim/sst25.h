@@ -0,0 +1,97 @@
+/* 
+ * Simulates SPI NOR flash chips on the SPI bus
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SST25_H
+#define SST25_H
+
+#include <stdint.h>
+
+enum {
+  SIM_MAX_CHIPS		= 3,
+};
+
+/**
+ * Busy times in nanoseconds.
+ */
+struct sst25_timing {
+  uint64_t byte_program;
+  uint64_t aai_program;
+  uint64_t page_program;
+  uint64_t sector_erase;
+  uint64_t block_erase;
+  uint64_t chip_erase;
+  uint64_t spi_byte;
+  uint64_t chip_select;
+};
+
+/**
+ * Everything we count on the bus.
+ */
+struct sst25_stats {
+  uint64_t spi_bytes;
+  uint64_t transactions;
+  uint64_t commands[0x100];
+  uint64_t bytes_programmed;
+  uint64_t erases;
+  uint64_t busy_polls;
+  /* Things the firmware shouldn't do */
+  uint64_t ignored_while_busy;
+  uint64_t ignored_no_wel;
+  uint64_t ignored_protected;
+  uint64_t ignored_in_aai;
+};
+
+/**
+ * A part that can be fitted to the sockets. Parts without AAI take
+ * page programs of up to page_size bytes instead.
+ */
+struct sim_part {
+  const char* name;
+  uint32_t size;
+  uint8_t id[2]; /* Read ID */
+  uint8_t jedec[3]; /* JEDEC ID */
+  uint16_t page_size; /* 0 for AAI */
+  const uint32_t* sfdp; /* The JEDEC basic parameter table, or NULL */
+  struct sst25_timing timing;
+};
+
+extern const struct sim_part* sim_part;
+extern struct sst25_timing sim_timing;
+extern struct sst25_stats sim_stats;
+extern uint64_t sim_now_ns;
+extern uint8_t sim_flash_powered;
+extern uint32_t sim_weak_cell_ppm; /* Record bytes that don't program properly, per million */
+
+uint8_t sim_flash_select_part(const char* name);
+void sim_flash_init(const char* image_path, uint8_t chips);
+void sim_flash_close(void);
+uint8_t* sim_flash_memory(uint8_t chip);
+void sim_advance_ns(uint64_t ns);
+uint8_t sim_flash_busy(uint8_t chip);
+void sim_run_until_idle(void);
+uint8_t sim_flash_so(uint64_t* ready_ns);
+void sim_flash_power(uint8_t on);
+void sim_stats_reset(void);
+
+#endif /* SST25_H */
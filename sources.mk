@@ -11,15 +11,21 @@ src/audio/wm8737.c \
 src/audio/i2c.c \
 src/audio/sampling.c \
 src/upload.c \
+src/dump.c \
 src/console.c \
 src/fft.c \
 src/envelope.c \
+src/rollup.c \
 src/settings.c \
 src/led.c \
 src/mem/wipe_mem.c \
+src/mem/scrub.c \
+src/mem/retention.c \
 src/mem/invalidate.c \
 src/mem/checksum.c \
 src/mem/write.c \
 src/mem/flash.c \
 src/mem/btree.c \
+src/mem/record.c \
+src/mem/time_index.c \
 src/timing.c \
@@ -30,6 +30,7 @@
 #include "upload.h"
 #include "pwrmon.h"
 #include "debug.h"
+#include "mem/write.h"
 
 /**
  * Defines how many logging intervals elapse between attempts to
@@ -40,6 +41,10 @@
 uint16_t time_update_counter = 0xFFFF;
 
 void comms(void) {
+  /* Write out any queued records so they can be uploaded */
+  flush_writes();
+  wait_for_write_complete();
+
   /* Wake up the radio */
   radio_wake();
 
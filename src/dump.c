@@ -0,0 +1,210 @@
+/* 
+ * Dumps the raw memory over the radio
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "dump.h"
+#include "radio/radio.h"
+#include "mem/flash.h"
+
+/**
+ * A dump goes out as frames that each start with a letter and the
+ * address they're about:
+ *
+ * 'M' address data...	The memory at address
+ * 'N' address length	length bytes from address are erased
+ * 'E' address		That's all, and there's no memory from address
+ *			to the end of what was asked for
+ *
+ * Addresses and lengths are 32-bit little endian, with the chip in the
+ * top byte. Only the 'E' frame asks for an ack. Each frame carries on
+ * from the last, except across the gaps between chips. So the gateway
+ * can tell which frames went missing from the addresses, and asks for
+ * those ranges again.
+ */
+enum {
+  /**
+   * The letter and the address
+   */
+  DUMP_HEADER_SIZE =		5,
+  /**
+   * As much memory as fits in a frame, after the MAC header and FCS
+   */
+  DUMP_DATA_SIZE =		127 - 9 - 2 - DUMP_HEADER_SIZE,
+  /**
+   * The number of frames we send each time dump is called
+   */
+  DUMP_FRAMES_AT_ONCE =		32,
+  /**
+   * Erased sectors are skipped with a single read each. This is how
+   * many of those reads we do each time dump is called
+   */
+  DUMP_SECTOR_SIZE =		0x1000,
+  DUMP_SECTORS_AT_ONCE =	16,
+};
+
+uint8_t dump_frame_buffer[DUMP_HEADER_SIZE + DUMP_DATA_SIZE];
+uint8_t blank_frame_buffer[DUMP_HEADER_SIZE + 4];
+
+/**
+ * Where we've got up to, and where we stop. Everything before
+ * dump_covered has been sent, or is in the run of erased memory.
+ */
+uint32_t dump_address, dump_end, dump_covered;
+/**
+ * Erased memory that we haven't told the gateway about yet
+ */
+uint32_t blank_address, blank_length;
+/**
+ * A request from the gateway. It comes in the radio interrupt, so it's
+ * kept here until dump() takes it up.
+ */
+volatile uint8_t dump_requested = 0;
+uint32_t requested_from, requested_to;
+
+/**
+ * Puts a 32-bit value in a frame.
+ */
+static void set_frame_word(uint8_t* frame, uint32_t value) {
+  frame[0] = value & 0xFF; value >>= 8;
+  frame[1] = value & 0xFF; value >>= 8;
+  frame[2] = value & 0xFF; value >>= 8;
+  frame[3] = value & 0xFF;
+}
+/**
+ * Sends the run of erased memory we've found, if there is one. Returns
+ * the number of frames sent.
+ */
+static uint8_t send_blank(void) {
+  if (blank_length == 0) { return 0; }
+
+  blank_frame_buffer[0] = 'N';
+  set_frame_word(blank_frame_buffer + 1, blank_address);
+  set_frame_word(blank_frame_buffer + DUMP_HEADER_SIZE, blank_length);
+  radio_transmit(blank_frame_buffer, DUMP_HEADER_SIZE + 4, BASE_STATION_ADDR, 0);
+
+  blank_length = 0;
+  return 1;
+}
+/**
+ * Adds length bytes at dump_address to the run of erased memory.
+ */
+static void add_blank(uint32_t length) {
+  if (blank_length == 0) { blank_address = dump_address; }
+  blank_length += length;
+  dump_covered = dump_address + length;
+}
+
+/**
+ * Starts a dump of the memory from between from and to, not including
+ * to. Any dump that's going already is dropped the next time dump() is
+ * called.
+ */
+void request_dump(uint32_t from, uint32_t to) {
+  requested_from = from;
+  requested_to = to;
+  dump_requested = 1;
+  dump_active = 1;
+}
+/**
+ * Sends some more of the dump. The memory's read straight into the
+ * frame, and erased sectors are skipped without sending them.
+ */
+void dump(void) {
+  uint8_t frames = 0, sectors = 0, length, i;
+  uint8_t chip;
+  uint32_t primask;
+
+  /* Take up any new request */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  if (dump_requested) {
+    dump_requested = 0;
+    dump_address = dump_covered = requested_from;
+    dump_end = requested_to;
+    blank_length = 0;
+  }
+  __set_PRIMASK(primask);
+
+  while (dump_active && frames < DUMP_FRAMES_AT_ONCE &&
+	 sectors < DUMP_SECTORS_AT_ONCE) {
+    /* If we're off the end of this chip, go on to the next one */
+    chip = dump_address >> 24;
+    if (chip >= FLASH_MAX_CHIPS || (dump_address & 0x00FFFFFF) >= flash_sizes[chip]) {
+      frames += send_blank();
+      dump_address = NextChip(dump_address, NO_WRAP);
+    }
+
+    /* If that's all of it, tell the gateway */
+    if (dump_address >= dump_end) { /* Including having no more chips */
+      frames += send_blank();
+      dump_frame_buffer[0] = 'E';
+      set_frame_word(dump_frame_buffer + 1, dump_covered);
+      radio_transmit(dump_frame_buffer, DUMP_HEADER_SIZE, BASE_STATION_ADDR, 1);
+
+      /* Unless another request has come in since */
+      primask = __get_PRIMASK();
+      __disable_irq();
+      dump_active = dump_requested;
+      __set_PRIMASK(primask);
+      return;
+    }
+
+    /* Skip over whole sectors that are erased */
+    if ((dump_address & (DUMP_SECTOR_SIZE - 1)) == 0 &&
+	dump_end - dump_address >= DUMP_SECTOR_SIZE) {
+      sectors++;
+      if (ReadFlashAND(dump_address, DUMP_SECTOR_SIZE) == 0xFF) {
+	add_blank(DUMP_SECTOR_SIZE);
+	dump_address += DUMP_SECTOR_SIZE;
+	continue;
+      }
+    }
+
+    /* Up to the end of the sector */
+    length = DUMP_DATA_SIZE;
+    if (DUMP_SECTOR_SIZE - (dump_address & (DUMP_SECTOR_SIZE - 1)) < length) {
+      length = DUMP_SECTOR_SIZE - (dump_address & (DUMP_SECTOR_SIZE - 1));
+    }
+    if (dump_end - dump_address < length) { length = dump_end - dump_address; }
+
+    ReadFlash(dump_address, dump_frame_buffer + DUMP_HEADER_SIZE, length);
+
+    for (i = 0; i < length && dump_frame_buffer[DUMP_HEADER_SIZE + i] == 0xFF; i++);
+    if (i == length) { /* It's all erased */
+      add_blank(length);
+    } else {
+      /* The erased memory before this has to go first */
+      frames += send_blank();
+
+      dump_frame_buffer[0] = 'M';
+      set_frame_word(dump_frame_buffer + 1, dump_address);
+      radio_transmit(dump_frame_buffer, DUMP_HEADER_SIZE + length, BASE_STATION_ADDR, 0);
+      frames++;
+      dump_covered = dump_address + length;
+    }
+    dump_address += length;
+  }
+
+  send_blank();
+}
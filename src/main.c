@@ -33,9 +33,13 @@
  * 1: EINT1_IRQn: Radio Interrupt. Needs to be above other interrupts
  * that use the radio functions so flags can be set and so on.
  *
- * 2: TIMER_32_1_IRQn: Flash write trigger. Allows writes to continue
- * while other processing is ongoing. Prevents EINT1_IRQn from
- * vectoring during part of the handler
+ * 2: TIMER_32_1_IRQn: Flash command queue. Allows writes and erases
+ * to continue while other processing is ongoing. Prevents EINT1_IRQn
+ * from vectoring during the handler, so EINT1_IRQn can run the queue
+ * itself if it needs the flash
+ * 2: PIOINT0_IRQn: RY/BY# from the flash on P0[8] during automatic
+ * writes. Holds off EINT1_IRQn while it's waiting as the flash is
+ * selected.
  * 2: I2C_IRQn: I2C Communications with WM8737. Isn't using SPI module so
  * can be interrupted by EINT1_IRQn.
  * 2: ADC_IRQn: Picks up the result of the ADC conversion. Not time
@@ -57,8 +61,8 @@
  *
  * LPC_CT32B0: Sleep Timer
  *
- * LPC_CT32B1: Waiting Time Byte Program when writing to external
- * memory
+ * LPC_CT32B1: Paces writes to external memory and polls for erases
+ * to complete
  *
  * main: Sends processor to deep-sleep
  *
@@ -70,6 +74,7 @@
 #include "audio/wm8737.h"
 #include "audio/sampling.h"
 #include "mem/flash.h"
+#include "mem/scrub.h"
 #include "mem/wipe_mem.h"
 #include "mem/write.h"
 #include "radio/radio.h"
@@ -80,8 +85,10 @@
 #include "console.h"
 #include "fft.h"
 #include "envelope.h"
+#include "rollup.h"
 #include "radio_callback.h"
 #include "comms.h"
+#include "dump.h"
 #include "sleeping.h"
 #include "led.h"
 #include "settings.h"
@@ -93,6 +100,9 @@ void infinite_deep_sleep(void);
 void do_battery(void);
 void do_comms(void);
 void do_calibration(void);
+void do_wipe(void);
+void do_scrub(void);
+void do_dump(void);
 
 /**
  * The entry point to the application.
@@ -118,8 +128,7 @@ int main(void) {
   flash_setup();
   spi_shutdown();
 
-  /* Optionally wipe the memory. This may take a few seconds... */
-  wipe_mem();
+  /* The memory is only wiped when the gateway asks, see do_wipe */
 
   /* Initialise the memory writing code */
   init_write();
@@ -152,6 +161,7 @@ int main(void) {
 void infinite_deep_sleep(void) {
   uint8_t has_logged = 0;
   uint32_t left_em_acc = 0, right_em_acc = 0;
+  uint32_t left_reading, right_reading;
   //uint16_t left_envelope = 0, right_envelope = 0;
   uint32_t acc_counter = 0;
 
@@ -170,6 +180,12 @@ void infinite_deep_sleep(void) {
     do_deep_sleep(1);
     increment_us(500*1000);
 
+    /**
+     * An automatic write might have been waiting on the flash when we
+     * went to sleep. It has to let go of the bus before sampling.
+     */
+    WaitForAutoWrite();
+
     if (is_time_valid()) {
       /* Fire up the ADC */
       prepare_sampling();
@@ -187,8 +203,13 @@ void infinite_deep_sleep(void) {
 	 * Add our samples to the accumulators. We skip the first 4 points of each sample.
 	 * TODO 48MHz clock?
 	 */
-	left_em_acc += fft_32(samples_left+2, get_left_tuned_bin()) >> 7;
-	right_em_acc += fft_32(samples_right+2, get_right_tuned_bin()) >> 7;
+	left_reading = fft_32(samples_left+2, get_left_tuned_bin()) >> 7;
+	right_reading = fft_32(samples_right+2, get_right_tuned_bin()) >> 7;
+	left_em_acc += left_reading;
+	right_em_acc += right_reading;
+
+	/* Roll this reading up into the longer periods too */
+	rollup_reading(left_reading, right_reading);
 
 	if (++acc_counter >= 128) { /* If we're ready to write to memory */
 	  /* Write em to memory */
@@ -221,11 +242,19 @@ void infinite_deep_sleep(void) {
       do_battery();
     } else { /* Invalid time */
       LED_TOGGLE();
+      /* Whatever's been rolled up so far has the wrong times */
+      rollup_reset();
     }
 
     /* Other tasks */
     do_comms();
+    do_dump();
+    do_wipe();
     do_calibration();
+    do_scrub();
+
+    /* Get branches that have been uploaded erased before we need them */
+    reclaim_ahead();
   }
 }
 /**
@@ -274,6 +303,19 @@ void do_comms(void) {
     transition_to_12_mhz();
   }
 }
+/**
+ * Sends some more of a memory dump on every wake while the gateway
+ * wants one, as it's far too much to wait for comms.
+ */
+void do_dump(void) {
+  if (dump_active) {
+    transition_to_24_mhz();
+    radio_wake();
+    dump();
+    radio_sleep();
+    transition_to_12_mhz();
+  }
+}
 /**
  * Periodically calibrates the watchdog oscillator.
  */
@@ -287,3 +329,32 @@ void do_calibration(void) {
     wait_for_calibration();
   }
 }
+/**
+ * Wipes the memory if the gateway has asked us to during comms. This
+ * may take a few seconds... Anything in the write queue goes too.
+ */
+void do_wipe(void) {
+  if (wipe_requested) {
+    wipe_requested = 0;
+
+    /* Let the last flush finish rather than erasing under it */
+    wait_for_write_complete();
+    wipe_mem();
+
+    /* Start from the beginning of the memory again */
+    init_write();
+  }
+}
+/**
+ * Periodically checks a few records in memory for corruption, on
+ * wakes where we haven't just been doing comms.
+ */
+uint16_t scrub_counter = 0;
+void do_scrub(void) {
+  if (++scrub_counter >= 20 && comms_counter != 0) { /* Every 10 seconds */
+    scrub_counter = 0;
+    /* Leaves are only valid once their records are written, so there's
+     * no need to wait for a flush */
+    scrub();
+  }
+}
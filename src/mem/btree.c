@@ -22,8 +22,11 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "mem/flash.h"
 #include "mem/btree.h"
+#include "mem/record.h"
 
 /* -------- BRANCH FUNCTIONS -------- */
 
@@ -37,39 +40,96 @@
 uint32_t leaf_addr_to_record_addr(uint32_t leaf_addr) {
   return (leaf_addr & 0xFFF00000) |
     ((leaf_addr & 0x0000F000) << 4) |
-    ((leaf_addr & 0x00000FFF) * RECORD_SIZE);
+    (BRANCH_HEADER_SIZE + (leaf_addr & 0x00000FFF) * RECORD_SIZE);
+}
+/**
+ * Moves the leaf marker to the last leaf of its branch, so the next
+ * call to next_record starts looking on the following branch.
+ */
+void skip_rest_of_branch(uint32_t* leaf_marker_addr) {
+  *leaf_marker_addr = (*leaf_marker_addr & 0xFFFFF000) | (MAX_RECORDS_PER_BRANCH - 1);
 }
 /**
  * Returns the status of the leaf at the given address on a branch.
  */
 uint8_t get_leaf_status(uint32_t address) {
   switch(ReadFlashByte(address)) {
-    case 0x00:
+    case LEAF_INVALID:
       return MEM_INVALID;
-    case 0xFF:
+    case LEAF_ERASED:
       return MEM_ERASED;
+    case LEAF_RESERVED:
+      return MEM_RESERVED;
     default:
       return MEM_VALID;
   }
 }
+/**
+ * Returns the address of the first erased leaf on the branch, or the
+ * address just past its last leaf if it's full. Leaves are written in
+ * order, so we can bisect for it.
+ */
+uint32_t find_branch_tail(uint32_t address) {
+  uint16_t low = 0, high = MAX_RECORDS_PER_BRANCH, mid;
+  address &= 0xFFFFF000;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (ReadFlashByte(address + mid) == LEAF_ERASED) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  return address + low;
+}
+/**
+ * Returns how many times the root or branch sector at the address has
+ * been erased, or ERASE_COUNT_UNKNOWN if that's not known.
+ */
+uint16_t get_erase_count(uint32_t address) {
+  return ReadFlashWord((address & 0xFFFFF000) + ERASE_COUNT_OFFSET);
+}
+/**
+ * Queues the erase of a root or branch sector, and writes its erase
+ * count back afterwards. A reset before the count's written back loses
+ * it, so a sector with no count is given the fewest any erased branch
+ * has. Anything else would have it used far too much or too little.
+ */
+void erase_counted_sector(uint32_t address) {
+  uint16_t count;
+  address &= 0xFFFFF000;
+
+  count = get_erase_count(address);
+  if (count == ERASE_COUNT_UNKNOWN) {
+    count = fewest_erases(address);
+    if (count == ERASE_COUNT_UNKNOWN) { count = 0; } /* A new chip */
+  }
+  if (count < ERASE_COUNT_UNKNOWN - 1) { count++; }
+
+  StartSectorErase(address, NULL);
+  StartWriteFlashByte(address + ERASE_COUNT_OFFSET, count & 0xFF, NULL);
+  StartWriteFlashByte(address + ERASE_COUNT_OFFSET + 1, count >> 8, NULL);
+}
 /**
  * Erase both the sector containing the given branch and the
- * corresponding page containing the records.
+ * corresponding page containing the records. The erases are queued,
+ * so they carry on while we get on with other things. Anything that
+ * reads the flash waits for them first.
  */
 void erase_branch(uint32_t address) {
   address &= 0xFFFFF000;
 
   deactivate_branch_on_root(address); /* Remove this branch from the root */
 
-  SectorErase(address); /* Erase the sector */
+  erase_counted_sector(address); /* Erase the sector */
 
   /* Convert the sector address to the corresponding page address */
-  address = leaf_addr_to_record_addr(address);
+  address = leaf_addr_to_record_addr(address) & 0xFFFF0000;
+  forget_branch_header(address); /* Our copy of the header is about to go stale */
 
-  WaitForBusyClear(address); /* Wait for the sector erase to finish */
-
-  PageErase(address); /* Erase the corresponding page */
-  WaitForBusyClear(address); /* Wait for the page erase to finish */
+  StartPageErase(address, NULL); /* Erase the corresponding page */
 }
 /**
  * Returns the address of the next leaf with the desired state on a
@@ -77,15 +137,27 @@ void erase_branch(uint32_t address) {
  * 0xFFFFFFFF. TODO Replace this function with a single flash read.
  */
 uint32_t traverse_current_branch(uint32_t address, uint8_t state) {
+  uint32_t tail;
   uint16_t i;
+  uint8_t leaf_status;
   address &= 0xFFF0FFFF; /* Make sure we're looking at the first page of the chip */
 
   /* For each leaf */
   for (i = (address & 0x00000FFF); i < MAX_RECORDS_PER_BRANCH; i++, address++) {
+    leaf_status = get_leaf_status(address);
     /* If it's in the desired state */
-    if (get_leaf_status(address) == state) {
+    if (leaf_status == state) {
       return address; /* Return the index */
     }
+
+    /* Leaves are written in order, so the erased ones are all at the end */
+    if (leaf_status == MEM_ERASED) {
+      break;
+    }
+    if (state == MEM_ERASED) {
+      tail = find_branch_tail(address);
+      return ((tail & 0x00000FFF) < MAX_RECORDS_PER_BRANCH) ? tail : 0xFFFFFFFF;
+    }
   }
 
   return 0xFFFFFFFF;
@@ -96,29 +168,41 @@ uint32_t traverse_current_branch(uint32_t address, uint8_t state) {
  * 0xFFFFFFFF. TODO Replace this function with a single flash read.
  */
 uint32_t traverse_entire_branch(uint32_t address, uint8_t state) {
+  uint32_t tail;
   uint16_t i;
   uint8_t leaf_status, branch_status = 0;
   address &= 0xFFFFF000;
 
+  /* Leaves are written in order, so the erased ones are all at the end */
+  if (state == MEM_ERASED) {
+    tail = find_branch_tail(address);
+    if ((tail & 0x00000FFF) < MAX_RECORDS_PER_BRANCH) {
+      return tail;
+    }
+    /* It's full. If all the leaves are invalid, erase it and use that */
+    if (ReadFlashByte(address + MAX_RECORDS_PER_BRANCH - 1) == LEAF_INVALID &&
+	ReadFlashOR(address, MAX_RECORDS_PER_BRANCH) == 0) {
+      erase_branch(address);
+      return address;
+    }
+    return 0xFFFFFFFF;
+  }
+
   for (i = 0; i < MAX_RECORDS_PER_BRANCH; i++, address++) { /* For each leaf */
     leaf_status = get_leaf_status(address);
     branch_status |= leaf_status;
     if (leaf_status == state) { /* If this leaf is in the desired state */
       return address; /* Return the index */
     }
+    if (leaf_status == MEM_ERASED) { /* The rest are erased too */
+      break;
+    }
   }
 
   if (branch_status == MEM_INVALID) { /* If all the leaves are invalid */
-    /* Erase the branch */
+    /* Erase the branch. This also marks it as inactive in the root.
+     * Usually reclaim_branch has got here first */
     erase_branch(address);
-
-    /* Mark the branch as inactive in the root */
-    deactivate_branch_on_root(address);
-
-    /* If we were looking for something that was erased */
-    if (state == MEM_ERASED) {
-      return address & 0xFFFFF000; /* Then the first leaf is now fine */
-    }
   } else if (branch_status == MEM_ERASED) { /* If all the leaves are erased */
     /* Mark this branch as inactive in the root */
     deactivate_branch_on_root(address);
@@ -135,6 +219,21 @@ uint32_t traverse_entire_branch(uint32_t address, uint8_t state) {
 uint32_t first_root(void) {
   return NextPage(0xFFFFFFFF);
 }
+/**
+ * Returns the address of the root after the given one. A chip bigger
+ * than 1 MByte has a tree in each 1 MByte of it. Returns 0xFFFFFFFF if
+ * there are no more roots and wrap is NO_WRAP.
+ */
+uint32_t next_root(uint32_t address, uint8_t wrap) {
+  address = (address & 0xFFF00000) + 0x00100000;
+
+  if ((address & 0x00FFFFFF) != 0 &&
+      (address & 0x00FFFFFF) < flash_sizes[address >> 24]) {
+    return address;
+  }
+
+  return NextChip(address - 0x00100000, wrap);
+}
 /**
  * Returns the address of the next active branch on the given
  * root. Returns 0xFFFFFFFF if there is no next active branch.
@@ -163,6 +262,34 @@ uint32_t next_branch(uint32_t current_branch_address) {
 
   return 0xFFFFFFFF;
 }
+/**
+ * Returns the fewest times any erased branch has been erased, or
+ * ERASE_COUNT_UNKNOWN if none of them are erased and counted.
+ */
+uint16_t fewest_erases(uint32_t address) {
+  uint32_t branch = address & 0xFFFFF000, first = 0xFFFFFFFF;
+  uint16_t count, fewest = ERASE_COUNT_UNKNOWN;
+
+  while (1) {
+    address = next_branch(branch);
+    if (address == 0xFFFFFFFF) { /* Off the end of this tree */
+      address = next_root(branch, WRAP);
+      if (address == 0xFFFFFFFF) { break; } /* No memory */
+      address |= 0x00001000;
+    }
+    branch = address;
+
+    if (branch == first) { break; } /* Been round them all */
+    if (first == 0xFFFFFFFF) { first = branch; }
+
+    if (ReadFlashByte(branch) == LEAF_ERASED) {
+      count = get_erase_count(branch); /* Unknown counts are left out */
+      if (count < fewest) { fewest = count; }
+    }
+  }
+
+  return fewest;
+}
 /**
  * Tidies up the root, maintaining the word that lives there.
  */
@@ -173,33 +300,39 @@ void tidy_root(uint32_t address, uint16_t current_offset) {
   /* Get the current value of the root */
   root = ReadFlashWord(address+current_offset);
   /* Erase the root sector */
-  SectorErase(address);
-  WaitForBusyClear(address);
+  erase_counted_sector(address);
   /* Write the root back to the start of the root sector */
   WriteFlashWord(address, root);
 }
 /**
  * Returns the offset of the root from the beginning of the chip in
- * bytes. If no root can be found, the function will return
- * 0xFFFF. TODO Replace this function with a single flash read.
+ * bytes. If no root can be found, the function will return 0xFFFF.
  *
- * The first word with MSB = 1 is the valid root. TODO Error checking.
+ * The first word with MSB = 1 is the valid root. Old roots are written
+ * to zero and the words after it are erased, so we can bisect for
+ * it. TODO Error checking.
  */
 uint16_t get_offset_of_root(uint32_t address) {
-  uint16_t i;
+  uint16_t low = 0, high = ROOT_SIZE, mid;
   address &= 0xFFF00000;
 
-  for (i = 0; i < ROOT_SIZE; i++, address += 2) {
-    if (ReadFlashWord(address) & 0x8000) { /* If MSB = 1 */
-      if (i == ROOT_SIZE-1) {
-	tidy_root(address, i);
-	return 0; /* tidy_root restores the root to the start of the root sector */
-      }
-      return i*2;
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (ReadFlashWord(address + mid*2) & 0x8000) { /* If MSB = 1 */
+      high = mid;
+    } else {
+      low = mid + 1;
     }
   }
 
-  return 0xFFFF;
+  if (low == ROOT_SIZE) {
+    return 0xFFFF;
+  }
+  if (low == ROOT_SIZE-1) {
+    tidy_root(address, low*2);
+    return 0; /* tidy_root restores the root to the start of the root sector */
+  }
+  return low*2;
 }
 /**
  * Returns the value of the root for a given chip.
@@ -230,8 +363,7 @@ void activate_branch_on_root(uint32_t address) {
     current_offset = get_offset_of_root(address);
 
     if (current_offset >= 0x1000) { /* Invalid Offset */
-      SectorErase(address); /* Initialise the root */
-      WaitForBusyClear(address);
+      erase_counted_sector(address); /* Initialise the root */
       current_offset = 0;
     }
     root = ReadFlashWord(address+current_offset);
@@ -258,8 +390,7 @@ void deactivate_branch_on_root(uint32_t address) {
     current_offset = get_offset_of_root(address);
 
     if (current_offset >= 0x1000) { /* Invalid Offset */
-      SectorErase(address); /* Initialise the root */
-      WaitForBusyClear(address);
+      erase_counted_sector(address); /* Initialise the root */
       current_offset = 0;
     }
     root = ReadFlashWord(address+current_offset);
@@ -270,6 +401,99 @@ void deactivate_branch_on_root(uint32_t address) {
   }
 }
 
+/* -------- RECLAIMING BRANCHES -------- */
+
+/**
+ * Branches that might have had all their leaves invalidated, laid out
+ * like the roots: bit 0 is branch 1. There's an entry for each tree,
+ * see tree_index. Only these get looked at, so reclaim_branch costs
+ * nothing when there's been no uploading.
+ */
+uint16_t reclaim_candidates[MAX_TREES];
+
+/**
+ * Returns where the tree the address is in goes in
+ * reclaim_candidates, or MAX_TREES if it's on a chip we can't queue
+ * erases for.
+ */
+static uint8_t tree_index(uint32_t address) {
+  if ((address >> 24) >= FLASH_MAX_CHIPS) { return MAX_TREES; }
+
+  return ((address >> 24) << 4) | ((address >> 20) & 0xF);
+}
+/**
+ * Notes that a leaf on this branch has been invalidated.
+ */
+void mark_for_reclaim(uint32_t leaf_addr) {
+  uint8_t tree = tree_index(leaf_addr);
+  uint8_t branch = (leaf_addr & 0x0000F000) >> 12;
+
+  if (tree < MAX_TREES && branch != 0) {
+    reclaim_candidates[tree] |= 1 << (branch-1);
+  }
+}
+/**
+ * Any branch that's active on a root could have been invalidated
+ * before we were reset.
+ */
+void init_reclaim(void) {
+  uint32_t address = first_root();
+
+  memset(reclaim_candidates, 0, sizeof(reclaim_candidates));
+
+  do {
+    if (tree_index(address) < MAX_TREES) {
+      reclaim_candidates[tree_index(address)] = get_root(address) & 0x7FFF;
+    }
+
+    address = next_root(address, NO_WRAP);
+  } while (address != 0xFFFFFFFF);
+}
+/**
+ * Looks through the candidates in the order the write cursor at the
+ * given address will reach them, and erases the first branch that has
+ * had every leaf invalidated. Branches on a busy chip are left for
+ * next time. The erase is queued, so this doesn't wait for it.
+ *
+ * Returns the address of the branch being erased, or 0xFFFFFFFF if
+ * there was nothing to reclaim.
+ */
+uint32_t reclaim_branch(uint32_t address) {
+  uint32_t start = address & 0xFFFFF000, branch = start;
+  uint16_t bit, i;
+  uint8_t tree;
+
+  for (i = 0; i < MAX_TREES*15; i++) {
+    address = next_branch(branch);
+    if (address == 0xFFFFFFFF) { /* Off the end of this tree */
+      address = next_root(branch, WRAP) | 0x00001000;
+    }
+    branch = address;
+
+    tree = tree_index(branch);
+    bit = 1 << (((branch & 0x0000F000) >> 12) - 1);
+
+    if (tree >= MAX_TREES || (reclaim_candidates[tree] & bit) == 0) {
+      if (branch == start) { break; } /* Been round them all */
+      continue;
+    }
+    if (FlashChipBusy(branch)) { /* Come back to it */
+      continue;
+    }
+    reclaim_candidates[tree] &= ~bit;
+
+    /* Leaves are written in order, so check the last one before reading
+     * the lot. All the leaves have to be 0x00 */
+    if (ReadFlashByte(branch + MAX_RECORDS_PER_BRANCH - 1) == 0 &&
+	ReadFlashOR(branch, MAX_RECORDS_PER_BRANCH) == 0) {
+      erase_branch(branch);
+      return branch;
+    }
+  }
+
+  return 0xFFFFFFFF;
+}
+
 /* -------- LOCATING LEAVES -------- */
 
 /**
@@ -281,6 +505,7 @@ uint32_t next_record(uint32_t* leaf_marker_addr, uint8_t state, uint8_t wrap) {
   uint16_t root; /* TODO pass root in args */
   uint32_t new_addr = *leaf_marker_addr + 1;
   uint32_t first_chip = 0xFFFFFFFF;
+  uint16_t wear_limit = 0xFFFF;
 
   /* First search on the current branch */
 
@@ -298,6 +523,13 @@ uint32_t next_record(uint32_t* leaf_marker_addr, uint8_t state, uint8_t wrap) {
     new_addr = *leaf_marker_addr + 1;
   }
 
+  /* Branches that have been erased a lot more than the least worn
+   * one are passed over, so they get a rest */
+  if (state == MEM_ERASED && wrap == WRAP) {
+    wear_limit = fewest_erases(*leaf_marker_addr);
+    if (wear_limit < 0xFFFF - WEAR_LEVEL_SLACK) { wear_limit += WEAR_LEVEL_SLACK; }
+  }
+
   /* Then look on other branches */
 
   while(1) {
@@ -317,6 +549,9 @@ uint32_t next_record(uint32_t* leaf_marker_addr, uint8_t state, uint8_t wrap) {
 
       *leaf_marker_addr = new_addr;
 
+      if (wear_limit != 0xFFFF && get_erase_count(new_addr) != ERASE_COUNT_UNKNOWN &&
+	  get_erase_count(new_addr) > wear_limit) { continue; }
+
       /* Look for leaves in the correct state */
       new_addr = traverse_entire_branch(*leaf_marker_addr, state);
 
@@ -330,8 +565,8 @@ uint32_t next_record(uint32_t* leaf_marker_addr, uint8_t state, uint8_t wrap) {
       }
     }
 
-    /* Move to the next chip */
-    new_addr = NextChip(*leaf_marker_addr, wrap);
+    /* Move to the next tree */
+    new_addr = next_root(*leaf_marker_addr, wrap);
 
     /* If there are no more chips */
     if (new_addr == 0xFFFFFFFF) {
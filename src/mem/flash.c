@@ -24,28 +24,82 @@
 
 #include "LPC11xx.h"
 #include <stdlib.h>
+#include <string.h>
 #include "mem/flash.h"
 #include "spi.h"
 #include "debug.h"
 
 /**
- *  Chip Enable lines are on
- * PIO1[6]
- * PIO1[7]
- * PIO1[8]
- * PIO2[0]
+ * The interrupt state from before the chip was selected.
  */
+static uint32_t chip_select_primask;
+
+/**
+ * What TMR32B1 was last started with, or 0 if it's stopped.
+ */
+static uint32_t flash_timer_ticks;
+
+static void QueueFlashCommand(struct flash_command* command);
+static void FinishFlashCommand(struct flash_chip* chip);
+static void RunFlashQueues(void);
+static uint32_t ClaimFlashChip(uint32_t address);
+#ifdef FLASH_HARDWARE_BUSY
+static void ReleaseBusyPin(void);
+#endif
+
+/**
+ * The SST25WF080 doesn't have SFDP tables. Its automatic writes are
+ * quicker than programming it a byte at a time.
+ */
+static const struct flash_part sst25wf080 = {
+  .size = 8 * 0x100000 / 8, .page_size = 0,
+  .sector_erase = FLASH_4KB_ERASE, .block_erase = FLASH_64KB_ERASE,
+  .program_ticks = FLASH_WRITE_TICK, .erase_ticks = FLASH_ERASE_TICK,
+};
+/**
+ * What we assume about a part that gives its size in its JEDEC ID but
+ * doesn't have SFDP.
+ */
+static const struct flash_part jedec_part = {
+  .size = 0, .page_size = 256,
+  .sector_erase = FLASH_4KB_ERASE, .block_erase = FLASH_64KB_ERASE,
+  .program_ticks = FLASH_TICKS_PER_MS, .erase_ticks = FLASH_ERASE_TICK,
+};
+
+/**
+ * The part in a socket. Until flash_setup has looked it's the
+ * SST25WF080 fitted to the board.
+ */
+static const struct flash_part* FlashPart(uint32_t address) {
+  if ((address >> 24) < FLASH_MAX_CHIPS) {
+    return &flash_chips[address >> 24].part;
+  }
+  return &sst25wf080;
+}
+
+/**
+ * The Chip Enable line for each socket on the board, in the order of
+ * the top byte of the address.
+ */
+static const struct flash_socket flash_sockets[FLASH_MAX_CHIPS] = {
+  { LPC_GPIO1, 7 },
+  { LPC_GPIO2, 0 },
+  { LPC_GPIO1, 8 },
+};
 
 void flash_init(void) {
   uint32_t i;
   writeflash_active = WRITEFLASH_INACTIVE;
-
-  /* Setup Chip Enable lines */
-  LPC_GPIO1->DIR |= (1<<7); /* Output */
-  LPC_GPIO2->DIR |= (1<<0); /* Output */
-  LPC_GPIO1->DIR |= (1<<8); /* Output */
-  /* Deselect all chips */
-  for (i = 0; i < 0x100; i++) { ChipSelectFlash(i<<24, FLASH_SSEL_DISABLE); }
+  for (i = 0; i < FLASH_MAX_CHIPS; i++) {
+    flash_chips[i].head = flash_chips[i].count = 0;
+    flash_chips[i].written = 0;
+    flash_chips[i].state = FLASHCHIP_IDLE;
+    if (flash_chips[i].part.size == 0) { flash_chips[i].part = sst25wf080; }
+
+    /* Setup the Chip Enable line and deselect the chip */
+    flash_sockets[i].port->DIR |= (1<<flash_sockets[i].pin); /* Output */
+    ChipSelectFlash(i<<24, FLASH_SSEL_DISABLE);
+  }
 
   /* Setup Reset Line P0[3], Active Low. Send it low to keep the chips off the bus! */
   LPC_GPIO0->DIR |= (1<<3); /* Output */
@@ -59,7 +113,7 @@ void flash_setup(void) {
 
   SetFlashReset(1); /* Take the chips out of reset */
 
-  for (i = 0; i < 0x100; i++) {
+  for (i = 0; i < FLASH_MAX_CHIPS; i++) {
     struct flashinfo info = ReadChipInfo(i << 24);
     /* Print the size and some debug information */
     total_mem += (flash_sizes[i] = IdentifyChip(info, i));
@@ -68,34 +122,158 @@ void flash_setup(void) {
   debug_printf("Total Memory = %d bytes\n\n", total_mem);
 }
 
-uint32_t IdentifyChip(struct flashinfo info, uint16_t num) {
+/**
+ * SFDP, as in JESD216.
+ */
+enum {
+  SFDP_SIGNATURE	= 0x50444653, /* "SFDP" */
+  SFDP_BASIC_TABLE	= 0x00, /* The parameter ID of the JEDEC basic table */
+  SFDP_BASIC_DWORDS	= 11, /* The ones we use */
+};
 
-  if (info.man_id == 0 || info.man_id == 0xFF) {
-    /* Ignore empty sockets */
+/**
+ * Reads size bytes from the SFDP tables.
+ */
+static void ReadSFDP(uint32_t address, uint32_t sfdp_address, uint8_t* buffer, uint32_t size) {
+  uint32_t index = 0;
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
+  ChipSelectFlash(address, FLASH_SSEL_ENABLE);
+
+  WriteCommandAddress(FLASH_READ_SFDP, sfdp_address); spi_write(0); spi_write(0);
+  /* Dump the first five bytes received */
+  spi_dump_bytes(5);
+  /* Read in the data */
+  while (index < size) {
+    /* Put another byte in the TxFIFO if required */
+    if (index + 1 < size) { spi_write(0); }
+    /* Read from the RxFIFO */
+    buffer[index++] = spi_read();
+  }
+
+  ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+  __set_PRIMASK(primask);
+}
+/**
+ * Converts an SFDP time of count+1 units into TMR32B1 ticks.
+ */
+static uint32_t SFDPTicks(uint32_t count, uint32_t unit_us) {
+  uint32_t ticks = ((count + 1) * unit_us * FLASH_TICKS_PER_MS) / 1000;
+
+  return ticks > 0 ? ticks : 1;
+}
+/**
+ * Fills in part from the JEDEC basic parameter table. Returns 0 if the
+ * chip doesn't have one, or needs something we can't do.
+ */
+static uint8_t DiscoverPart(uint32_t address, struct flash_part* part) {
+  uint32_t header[4], table[SFDP_BASIC_DWORDS];
+  uint32_t dwords, erase_type, sector_ms = 0;
+  uint8_t i;
+  /* The units of the erase times in DWORD 10 */
+  static const uint16_t erase_unit_ms[4] = { 1, 16, 128, 1000 };
+
+  /* The SFDP header and the first parameter header */
+  ReadSFDP(address, 0, (uint8_t*)header, sizeof(header));
+  if (header[0] != SFDP_SIGNATURE || (header[2] & 0xFF) != SFDP_BASIC_TABLE) {
+    return 0;
+  }
+
+  dwords = header[2] >> 24;
+  if (dwords < 9) { return 0; } /* Too old to list its erase commands */
+  if (dwords > SFDP_BASIC_DWORDS) { dwords = SFDP_BASIC_DWORDS; }
+
+  memset(table, 0, sizeof(table));
+  ReadSFDP(address, header[3] & 0xFFFFFF, (uint8_t*)table, dwords*4);
+
+  /* We send three byte addresses */
+  if (((table[0] >> 17) & 0x3) == 0x2) { return 0; }
+
+  /* Density is in bits */
+  if (table[1] & 0x80000000) {
+    i = table[1] & 0x1F; /* 2^N */
+    part->size = (i >= 27) ? 0x1000000 : (1UL << i) / 8;
   } else {
-    debug_printf("Socket %d: ", num+1);
-
-    if (info.man_id == 0xBF) { // SST
-      debug_printf("SST ");
-      if (info.dev_id == 0x5) {
-	debug_puts("SST25WF080 (8 MBit)");
-	return 8 * 0x100000 / 8;
-      } else {
-	debug_printf("Unknown  ");
+    part->size = (table[1] + 1) / 8;
+  }
+
+  /* Look through the erase types for 4 KByte and 64 KByte */
+  part->sector_erase = part->block_erase = 0;
+  for (i = 0; i < 4; i++) {
+    erase_type = (table[7 + i/2] >> ((i & 1) * 16)) & 0xFFFF;
+
+    if ((erase_type & 0xFF) == 12) {
+      part->sector_erase = erase_type >> 8;
+      if (dwords >= 10) { /* Typical erase time */
+	sector_ms = (((table[9] >> (4 + i*7)) & 0x1F) + 1) *
+	  erase_unit_ms[(table[9] >> (9 + i*7)) & 0x3];
       }
-    } else {
-      debug_printf("Unknown  ");
+    } else if ((erase_type & 0xFF) == 16) {
+      part->block_erase = erase_type >> 8;
     }
+  }
+  if (part->sector_erase == 0 || part->block_erase == 0) { return 0; }
+
+  /* Look at an erase about eight times while it's going */
+  part->erase_ticks = (sector_ms * FLASH_TICKS_PER_MS) / 8;
+  if (part->erase_ticks < FLASH_ERASE_TICK) { part->erase_ticks = FLASH_ERASE_TICK; }
+
+  if (dwords >= 11) { /* Page size and typical page program time */
+    part->page_size = 1 << ((table[10] >> 4) & 0xF);
+    part->program_ticks = SFDPTicks((table[10] >> 8) & 0x1F,
+				    (table[10] & (1 << 13)) ? 64 : 8);
+  } else { /* Just whether it's at least 64 bytes */
+    part->page_size = (table[0] & (1 << 2)) ? 64 : 1;
+    part->program_ticks = FLASH_TICKS_PER_MS;
+  }
+
+  return 1;
+}
+/**
+ * Works out what's in a socket and returns its size. The part goes in
+ * flash_chips so the queue knows how to write and erase it.
+ */
+uint32_t IdentifyChip(struct flashinfo info, uint16_t num) {
+  struct flash_part part;
+
+  if (info.man_id == 0 || info.man_id == 0xFF) {
+    return 0; /* Ignore empty sockets */
+  }
+  if (num >= FLASH_MAX_CHIPS) {
+    return 0; /* We can't select it anyway */
+  }
 
-    debug_printf("JEDEC Manufacturer's ID: %d JEDEC Memory Type: %d JEDEC Memory Size: %d\n",
-		 info.jedec_man_id, info.jedec_mem_type, info.jedec_mem_capacity);
+  debug_printf("Socket %d: ", num+1);
+
+  if (info.man_id == 0xBF && info.dev_id == 0x5) { // SST
+    debug_printf("SST SST25WF080 (8 MBit) ");
+    part = sst25wf080;
+  } else if (DiscoverPart(num << 24, &part)) {
+    debug_printf("SFDP %d bytes, %d byte pages ", part.size, part.page_size);
+  } else if (info.jedec_mem_capacity >= 20 && info.jedec_mem_capacity <= 24) {
+    /* Most parts give log2 of their size here */
+    part = jedec_part;
+    part.size = 1UL << info.jedec_mem_capacity;
+    debug_printf("JEDEC %d bytes ", part.size);
+  } else {
+    debug_printf("Unknown  ");
+    part.size = 0;
   }
 
-  return 0;
+  debug_printf("JEDEC Manufacturer's ID: %d JEDEC Memory Type: %d JEDEC Memory Size: %d\n",
+	       info.jedec_man_id, info.jedec_mem_type, info.jedec_mem_capacity);
+  if (part.size == 0) { return 0; }
+
+  /* We only use three byte addresses */
+  if (part.size > 0x1000000) { part.size = 0x1000000; }
+
+  flash_chips[num].part = part;
+  return part.size;
 }
 
 struct flashinfo ReadChipInfo(uint32_t address) {
   struct flashinfo info;
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
 
   ChipSelectFlash(address, FLASH_SSEL_ENABLE);
 
@@ -118,6 +296,7 @@ struct flashinfo ReadChipInfo(uint32_t address) {
   info.jedec_mem_capacity = spi_read();
 
   ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+  __set_PRIMASK(primask);
 
   return info;
 }
@@ -126,6 +305,7 @@ struct flashinfo ReadChipInfo(uint32_t address) {
 
 uint8_t ReadFlashByte(uint32_t address) {
   uint8_t value;
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
 
   ChipSelectFlash(address, FLASH_SSEL_ENABLE);
 
@@ -136,10 +316,13 @@ uint8_t ReadFlashByte(uint32_t address) {
   value = spi_read();
 
   ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+  __set_PRIMASK(primask);
 
   return value;
 }
 void WriteFlashByte(uint32_t address, uint8_t data) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   if (WriteUnprotect(address) > 0) { /* If write enable was successful */
     /* Unlock write mode */
     SingleCommand(address, FLASH_WRITE_ENABLE);
@@ -155,6 +338,8 @@ void WriteFlashByte(uint32_t address, uint8_t data) {
     /* Wait for the signal that the write has completed */
     WaitForBusyClear(address);
   }
+
+  __set_PRIMASK(primask);
 }
 /**
  * Returns the bitwise AND of size bytes starting from address
@@ -162,6 +347,8 @@ void WriteFlashByte(uint32_t address, uint8_t data) {
 uint8_t ReadFlashAND(uint32_t address, uint32_t size) { /* This will wrap-around */
   if (size > 0) {
     uint32_t index = 0; uint8_t result = 0xFF;
+    uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
     ChipSelectFlash(address, FLASH_SSEL_ENABLE);
 
     WriteCommandAddress(FLASH_SPEED_READ, address); spi_write(0); spi_write(0);
@@ -176,17 +363,48 @@ uint8_t ReadFlashAND(uint32_t address, uint32_t size) { /* This will wrap-around
     }
 
     ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+    __set_PRIMASK(primask);
     return result;
   } else {
     return 0;
   }
 }
+/**
+ * Returns the bitwise OR of size bytes starting from address
+ */
+uint8_t ReadFlashOR(uint32_t address, uint32_t size) { /* This will wrap-around */
+  if (size > 0) {
+    uint32_t index = 0; uint8_t result = 0;
+    uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
+    ChipSelectFlash(address, FLASH_SSEL_ENABLE);
+
+    WriteCommandAddress(FLASH_SPEED_READ, address); spi_write(0); spi_write(0);
+    /* Dump the first five bytes received */
+    spi_dump_bytes(5);
+    /* Read in the data */
+    while (index++ < size) {
+      /* Put another byte in the TxFIFO if required */
+      if (index < size) { spi_write(0); }
+      /* Read from the RxFIFO */
+      result |= spi_read();
+    }
+
+    ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+    __set_PRIMASK(primask);
+    return result;
+  } else {
+    return 0xFF;
+  }
+}
 /**
  * Reads a block of memory from flash.
  */
 uint8_t ReadFlash(uint32_t address, uint8_t* buffer, uint32_t size) { /* This will wrap-around */
   if (size > 0) {
     uint32_t index = 0;
+    uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
     ChipSelectFlash(address, FLASH_SSEL_ENABLE);
 
     WriteCommandAddress(FLASH_SPEED_READ, address); spi_write(0); spi_write(0);
@@ -201,11 +419,119 @@ uint8_t ReadFlash(uint32_t address, uint8_t* buffer, uint32_t size) { /* This wi
     }
 
     ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+    __set_PRIMASK(primask);
     return 1;
   } else {
     return 0;
   }
 }
+/**
+ * Compares size bytes starting from address with buffer, in one read.
+ * Returns 1 if they're all the same.
+ */
+uint8_t CompareFlash(uint32_t address, uint8_t* buffer, uint32_t size) { /* This will wrap-around */
+  if (size > 0) {
+    uint32_t index = 0; uint8_t difference = 0;
+    uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
+    ChipSelectFlash(address, FLASH_SSEL_ENABLE);
+
+    WriteCommandAddress(FLASH_SPEED_READ, address); spi_write(0); spi_write(0);
+    /* Dump the first five bytes received */
+    spi_dump_bytes(5);
+    /* Read in the data */
+    while (index < size) {
+      /* Put another byte in the TxFIFO if required */
+      if (index + 1 < size) { spi_write(0); }
+      /* Read from the RxFIFO */
+      difference |= spi_read() ^ buffer[index++];
+    }
+
+    ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+    __set_PRIMASK(primask);
+    return (difference == 0);
+  } else {
+    return 1;
+  }
+}
+
+/* -------- STREAMING READS -------- */
+
+/**
+ * Sets up a stream to read from address. Nothing's read until the
+ * first call to ReadFlashStream.
+ */
+void OpenFlashStream(struct flash_stream* stream, uint32_t address) {
+  stream->address = address;
+  stream->open = 0;
+}
+/**
+ * Moves the stream on to address. Short gaps forward are clocked
+ * through, otherwise the read is started again there.
+ */
+void SeekFlashStream(struct flash_stream* stream, uint32_t address) {
+  if (stream->open && address >= stream->address &&
+      (address >> 24) == stream->chip &&
+      address - stream->address <= FLASH_STREAM_SKIP) {
+    while (stream->address < address) {
+      spi_write(0); spi_read(); stream->address++;
+    }
+  } else {
+    CloseFlashStream(stream);
+    stream->address = address;
+  }
+}
+/**
+ * Reads the next size bytes of the stream into buffer. Once the end
+ * of a chip is reached it carries on from the start of the next.
+ */
+void ReadFlashStream(struct flash_stream* stream, uint8_t* buffer, uint32_t size) {
+  uint32_t index = 0, count;
+  uint8_t chip;
+
+  while (index < size) {
+    chip = stream->address >> 24;
+    if (chip >= FLASH_MAX_CHIPS || (stream->address & 0x00FFFFFF) >= flash_sizes[chip]) {
+      /* Off the end of this chip */
+      CloseFlashStream(stream);
+      stream->address = NextChip(stream->address, WRAP);
+      if (stream->address == 0xFFFFFFFF) { return; } /* No memory */
+      continue;
+    }
+    if (!stream->open) {
+      stream->primask = ClaimFlashChip(stream->address); /* The chip has to be free */
+      ChipSelectFlash(stream->address, FLASH_SSEL_ENABLE);
+      WriteCommandAddress(FLASH_SPEED_READ, stream->address); spi_write(0);
+      /* Dump the first five bytes received */
+      spi_dump_bytes(5);
+      stream->chip = chip;
+      stream->open = 1;
+    }
+
+    /* Read in the data, up to the end of the chip */
+    count = flash_sizes[chip] - (stream->address & 0x00FFFFFF);
+    if (count > size - index) { count = size - index; }
+    stream->address += count;
+
+    spi_write(0);
+    while (count-- > 1) {
+      /* Put another byte in the TxFIFO, then read from the RxFIFO */
+      spi_write(0);
+      buffer[index++] = spi_read();
+    }
+    buffer[index++] = spi_read();
+  }
+}
+/**
+ * Ends the read, so the bus and the flash can be used again.
+ */
+void CloseFlashStream(struct flash_stream* stream) {
+  if (stream->open) {
+    ChipSelectFlash((uint32_t)stream->chip << 24, FLASH_SSEL_DISABLE);
+    __set_PRIMASK(stream->primask);
+    stream->open = 0;
+  }
+}
 
 /* -------- WORD READ/WRITE -------- */
 
@@ -231,78 +557,613 @@ uint16_t ReadFlashWord(uint32_t address) {
 
 /* -------- AUTOMATIC WRITE -------- */
 
-void StartWriteFlash(uint32_t address, uint8_t* record, uint32_t len) { /* Async */
-  /* Wait for any current write to complete */
-  while (writeflash_active);
+/**
+ * Queues an automatic write of len bytes from record. The buffer must
+ * stay put until the write has completed. Parts without AAI have it
+ * page programmed instead.
+ */
+void StartWriteFlash(uint32_t address, uint8_t* record, uint32_t len, flash_callback callback) { /* Async */
+  struct flash_command command = {
+    .command = FLASHQ_AUTO_WRITE, .address = address, .data = record, .len = len,
+    .callback = callback,
+  };
 
-  if (WriteUnprotect(address) > 0) { /* If write enable was successful */
+  QueueFlashCommand(&command);
+}
+/**
+ * Writes out another two bytes from the buffer.
+ */
+static void WriteNextTwoBytes(void) {
+  ChipSelectFlash(writeflash_address, FLASH_SSEL_ENABLE);
+  spi_write(FLASH_AUTO_WRITE);
+  spi_write(writeflash_record[writeflash_index++]);
+  spi_write(writeflash_record[writeflash_index++]);
+  spi_dump_bytes(3);
+  ChipSelectFlash(writeflash_address, FLASH_SSEL_DISABLE);
+
+  /* If we've reached the end of this record */
+  if (writeflash_index >= writeflash_len) {
+    /* We've finished writing out. Set the flag */
+    writeflash_active = WRITEFLASH_FINISHING; /* Finishing */
+  }
+}
+/**
+ * Called once the last two bytes have gone in.
+ */
+static void EndAutoWrite(void) {
+  /* Exit the auto write mode */
+  SingleCommand(writeflash_address, FLASH_WRITE_DISABLE);
+#ifdef FLASH_HARDWARE_BUSY
+  SingleCommand(writeflash_address, FLASH_BUSY_DISABLE);
+#endif
+
+  writeflash_active = WRITEFLASH_INACTIVE;
+  FinishFlashCommand(&flash_chips[writeflash_address >> 24]);
+}
+
+#ifdef FLASH_HARDWARE_BUSY
+/**
+ * With FLASH_BUSY_ENABLE the chip drives RY/BY# on SO during an
+ * automatic write whenever it's selected, so we hold it selected and
+ * take P0[8] over as a GPIO. Its rising edge gives us PIOINT0 as soon
+ * as the chip is ready for the next two bytes.
+ *
+ * The radio shares the bus, so its interrupt is held off while we're
+ * waiting, and anything else that wants the bus waits in
+ * ClaimSharedBus. That's never longer than one two byte program. The
+ * other chips have to wait too.
+ */
+static uint8_t busy_pin_held;
+static uint8_t radio_irq_was_enabled;
+
+/**
+ * Selects the chip and waits for RY/BY#. If the chip was already
+ * ready it's let go again straight away.
+ */
+static void HoldForBusyPin(void) {
+  radio_irq_was_enabled = (NVIC->ISER[0] & (1 << PIOINT1_IRQn)) ? 1 : 0;
+  NVIC_DisableIRQ(PIOINT1_IRQn);
+
+  LPC_IOCON->PIO0_8 &= ~0x07;		/* GPIO, leave the pull-ups on */
+  LPC_GPIO0->DIR &= ~(1 << 8);		/* Input */
+  LPC_GPIO0->IS &= ~(1 << 8);		/* Edge sensitive */
+  LPC_GPIO0->IBE &= ~(1 << 8);
+  LPC_GPIO0->IEV |= (1 << 8);		/* Rising edge */
+
+  ChipSelectFlash(writeflash_address, FLASH_SSEL_ENABLE);
+  __set_PRIMASK(chip_select_primask);	/* We're staying selected */
+  LPC_GPIO0->IC |= (1 << 8);		/* Forget edges from the SPI traffic */
+
+  if (LPC_GPIO0->MASKED_ACCESS[1 << 8]) { /* Already ready */
+    ReleaseBusyPin();
+    return;
+  }
+
+  /* Any edge from here on gets latched, even before IE is set */
+  LPC_GPIO0->IE |= (1 << 8);
+  busy_pin_held = 1;
+
+  NVIC_SetPriority(PIOINT0_IRQn, 2);
+  NVIC_EnableIRQ(PIOINT0_IRQn);
+}
+/**
+ * Lets the chip go and gives P0[8] back to the SPI bus.
+ */
+static void ReleaseBusyPin(void) {
+  LPC_GPIO0->IE &= ~(1 << 8);
+  NVIC_DisableIRQ(PIOINT0_IRQn);
+  busy_pin_held = 0;
+
+  chip_select_primask = __get_PRIMASK(); /* Leave the interrupts as they are now */
+  ChipSelectFlash(writeflash_address, FLASH_SSEL_DISABLE);
+  LPC_GPIO0->IC |= (1 << 8);		/* SO going high-Z makes an edge too */
+
+  LPC_IOCON->PIO0_8 |= 0x01;		/* SSP MISO */
+
+  if (radio_irq_was_enabled) {
+    NVIC_EnableIRQ(PIOINT1_IRQn);
+  }
+}
+/**
+ * RY/BY# has gone high.
+ */
+void PIOINT0_IRQHandler(void) {
+  uint32_t primask;
+
+  /* We might have already been run by StepFlashQueue */
+  if (busy_pin_held == 0) { return; }
+  /* Edges are missed in deep sleep, so it's the level that counts */
+  if (LPC_GPIO0->MASKED_ACCESS[1 << 8] == 0) { return; }
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+
+  ReleaseBusyPin();
+  RunFlashQueues();
+
+  __set_PRIMASK(primask);
+}
+#endif
+/**
+ * Puts the next two bytes of the automatic write in, or ends it if
+ * they've all gone.
+ */
+static void ContinueAutoWrite(struct flash_chip* chip) {
+  if (writeflash_active == WRITEFLASH_FINISHING) {
+    EndAutoWrite();
+    return;
+  }
+
+  WriteNextTwoBytes();
+#ifdef FLASH_HARDWARE_BUSY
+  chip->state = FLASHCHIP_AUTO;
+  HoldForBusyPin();
+#else
+  chip->ticks = chip->part.program_ticks;
+#endif
+}
+void TIMER32_1_IRQHandler(void) {
+  uint32_t primask;
+
+  /* We might have already been run by StepFlashQueue */
+  if (flash_timer_ticks == 0 || (LPC_CT32B1->IR & 1) == 0) { return; }
+
+  /* The radio interrupt mustn't get in half way through this */
+  primask = __get_PRIMASK();
+  __disable_irq();
+
+  RunFlashQueues();
+
+  __set_PRIMASK(primask);
+}
+/**
+ * Stops TMR32B1 once the queues have nothing more for it.
+ */
+void EndWriteFlash() {
+  /* Disable the interrupt */
+  NVIC_DisableIRQ(TIMER_32_1_IRQn);
+
+  LPC_SYSCON->SYSAHBCLKCTRL &= ~(1 << 10); /* Disconnect the clock from TMR32B1 */
+}
+
+/* -------- COMMAND QUEUE -------- */
+
+/**
+ * Automatic writes, byte writes, erases and waiting for the busy bit
+ * all go through a queue for each chip. TMR32B1 paces the automatic
+ * writes and polls the status register until each command completes,
+ * then the next command for that chip is started and the callback for
+ * the completed one is made. The commands for a chip are always
+ * carried out in the order they were queued, so something queued
+ * after a write can rely on it. Commands for different chips run
+ * alongside each other, apart from AAI writes which go one at a
+ * time. Page programmed parts only need their own chip's state.
+ *
+ * Everything else that talks to a chip waits for its queue to empty
+ * first, so only the queue needs to know what's in progress.
+ */
+
+/**
+ * Set while RunFlashQueues is running.
+ */
+static uint8_t flash_queues_running;
+
+/**
+ * Starts TMR32B1 with the given tick.
+ */
+static void StartFlashTimer(uint32_t tick) {
+  LPC_SYSCON->SYSAHBCLKCTRL |= (1 << 10); /* Connect the clock to TMR32B1 */
+
+  LPC_CT32B1->TCR = 0x2; /* Put the counter into reset */
+  LPC_CT32B1->PR = FLASH_TICK_PRESCALE;
+  LPC_CT32B1->MR0 = tick;
+  LPC_CT32B1->MCR |= (1<<0)|(1<<2); /* Interrupt and stop on MR0 */
+  LPC_CT32B1->IR |= 0x3F; /* Clear all the timer interrupts */
+
+  NVIC_SetPriority(TIMER_32_1_IRQn, 2);
+  NVIC_EnableIRQ(TIMER_32_1_IRQn);
+
+  LPC_CT32B1->TCR = 0x1; /* Start the counter */
+  flash_timer_ticks = tick;
+}
+/**
+ * Stops TMR32B1 and returns how many ticks it got through.
+ */
+static uint32_t StopFlashTimer(void) {
+  uint32_t elapsed;
+
+  if (flash_timer_ticks == 0) { return 0; }
+
+  LPC_CT32B1->TCR = 0x0; /* Stop the counter */
+  if (LPC_CT32B1->IR & 1) { /* It reached MR0 */
+    elapsed = flash_timer_ticks;
+  } else {
+    elapsed = LPC_CT32B1->TC;
+  }
+  LPC_CT32B1->IR |= 0x3F; /* Clear all the timer interrupts */
+  NVIC_ClearPendingIRQ(TIMER_32_1_IRQn);
+
+  flash_timer_ticks = 0;
+  return elapsed;
+}
+/**
+ * How long to leave a command before looking at the status register.
+ */
+static uint32_t PollTicks(struct flash_chip* chip, uint8_t command) {
+  switch (command) {
+    case FLASHQ_BYTE_WRITE:
+      return FLASH_BYTE_TICK;
+    case FLASHQ_SECTOR_ERASE:
+    case FLASHQ_PAGE_ERASE:
+    case FLASHQ_CHIP_ERASE:
+      return chip->part.erase_ticks;
+    default:
+      return chip->part.program_ticks;
+  }
+}
+/**
+ * Programs as much of the write as fits in the rest of the chip's
+ * page. Called with write enabled.
+ */
+static void ProgramNextPage(struct flash_chip* chip) {
+  struct flash_command* command = &chip->queue[chip->head];
+  uint32_t address = command->address + chip->written;
+  uint32_t len = chip->part.page_size - (address % chip->part.page_size);
+
+  if (len > command->len - chip->written) { len = command->len - chip->written; }
+
+  ChipSelectFlash(address, FLASH_SSEL_ENABLE);
+  WriteCommandAddress(FLASH_PAGE_PROGRAM, address); spi_dump_bytes(4);
+  while (len--) {
+    spi_write(command->data[chip->written++]); spi_dump_bytes(1);
+  }
+  ChipSelectFlash(address, FLASH_SSEL_DISABLE);
+}
+/**
+ * Sends the command at the head of the chip's queue to the chip.
+ */
+static void StartFlashCommand(struct flash_chip* chip) {
+  struct flash_command* command = &chip->queue[chip->head];
+  uint32_t address = command->address;
+
+  chip->state = FLASHCHIP_TIMED;
+  chip->ticks = PollTicks(chip, command->command);
+
+  /* If write enable was successful */
+  if (command->command != FLASHQ_WAIT && WriteUnprotect(address) > 0) {
+    if (command->command == FLASHQ_AUTO_WRITE && chip->part.page_size) {
+      /* One page at a time, see ServiceFlashChip */
+      SingleCommand(address, FLASH_WRITE_ENABLE);
+      ProgramNextPage(chip);
+      return;
+    }
+#ifdef FLASH_HARDWARE_BUSY
+    if (command->command == FLASHQ_AUTO_WRITE) {
+      /* Have RY/BY# come out on SO */
+      SingleCommand(address, FLASH_BUSY_ENABLE);
+    }
+#endif
     /* Unlock write mode */
     SingleCommand(address, FLASH_WRITE_ENABLE);
 
-    /* Write out the address and the first two bytes of the header */
     ChipSelectFlash(address, FLASH_SSEL_ENABLE);
-    WriteCommandAddress(FLASH_AUTO_WRITE, address); spi_write(record[0]); spi_write(record[1]);
-    spi_dump_bytes(6);
-    ChipSelectFlash(address, FLASH_SSEL_DISABLE);
 
-    /* Put all the values into global variables for access during the interrupt */
-    writeflash_active = WRITEFLASH_ACTIVE;
-    writeflash_address = address;
-    writeflash_len = len;
-    writeflash_index = 2; /* We've already done two */
-    writeflash_record = record;
+    switch (command->command) {
+      case FLASHQ_AUTO_WRITE:
+	/* Write out the address and the first two bytes of the header */
+	WriteCommandAddress(FLASH_AUTO_WRITE, address);
+	spi_write(command->data[0]); spi_write(command->data[1]);
+	spi_dump_bytes(6);
+
+	/* Put all the values into global variables for access during the interrupt */
+	if (command->len > 2) {
+	  writeflash_active = WRITEFLASH_ACTIVE;
+	} else { /* Those two bytes were all of it */
+	  writeflash_active = WRITEFLASH_FINISHING;
+	}
+	writeflash_address = address;
+	writeflash_len = command->len;
+	writeflash_index = 2; /* We've already done two */
+	writeflash_record = command->data;
+	break;
+      case FLASHQ_BYTE_WRITE:
+	WriteCommandAddress(FLASH_BYTE_WRITE, address); spi_write(command->value);
+	spi_dump_bytes(5);
+	break;
+      case FLASHQ_SECTOR_ERASE:
+	WriteCommandAddress(chip->part.sector_erase, address); spi_dump_bytes(4);
+	break;
+      case FLASHQ_PAGE_ERASE:
+	WriteCommandAddress(chip->part.block_erase, address); spi_dump_bytes(4);
+	break;
+      case FLASHQ_CHIP_ERASE:
+	spi_write(FLASH_CHIP_ERASE); spi_dump_bytes(1);
+	break;
+      default: break;
+    }
 
-    /* Configure TMR32B1 to trigger every 25µS */
-    LPC_SYSCON->SYSAHBCLKCTRL |= (1 << 10); /* Connect the clock to TMR32B1 */
+    ChipSelectFlash(address, FLASH_SSEL_DISABLE);
 
-    LPC_CT32B1->TCR = 0x2; /* Put the counter into reset */
-    LPC_CT32B1->PR = 25; /* Trigger after 25µS */
-    LPC_CT32B1->MR0 = 48;
-    LPC_CT32B1->MCR |= (1<<0)|(1<<2); /* Interrupt and stop on MR0 */
-    LPC_CT32B1->IR |= 0x3F; /* Clear all the timer interrupts */
+#ifdef FLASH_HARDWARE_BUSY
+    if (command->command == FLASHQ_AUTO_WRITE) {
+      chip->state = FLASHCHIP_AUTO;
+      HoldForBusyPin();
+    }
+#endif
+  }
+}
+/**
+ * Takes the command at the head of the chip's queue off once it has
+ * completed.
+ */
+static void FinishFlashCommand(struct flash_chip* chip) {
+  flash_callback callback = chip->queue[chip->head].callback;
+  uint32_t address = chip->queue[chip->head].address;
 
-    NVIC_SetPriority(TIMER_32_1_IRQn, 2);
-    NVIC_EnableIRQ(TIMER_32_1_IRQn);
+  chip->head = (chip->head + 1) % FLASH_QUEUE_LENGTH;
+  chip->count--;
+  chip->written = 0;
+  chip->state = FLASHCHIP_IDLE;
 
-    LPC_CT32B1->TCR = 0x1; /* Start the counter */
+  if (callback) {
+    callback(address);
   }
 }
-void TIMER32_1_IRQHandler(void) {
-  LPC_CT32B1->IR |= 0x3F; /* Clear all the timer interrupts */
+/**
+ * Called when TMR32B1 says it's time to look at the chip again.
+ */
+static void ServiceFlashChip(struct flash_chip* chip) {
+  struct flash_command* command = &chip->queue[chip->head];
+
+  if (command->command == FLASHQ_AUTO_WRITE && writeflash_active != WRITEFLASH_INACTIVE &&
+      (writeflash_address >> 24) == (command->address >> 24)) {
+    ContinueAutoWrite(chip);
+  } else if (ReadFlashStatus(command->address) & 1) { /* Still busy */
+    chip->ticks = PollTicks(chip, command->command); /* Look again later */
+  } else if (chip->written > 0 && chip->written < command->len) { /* Next page */
+    SingleCommand(command->address, FLASH_WRITE_ENABLE);
+    ProgramNextPage(chip);
+    chip->ticks = PollTicks(chip, command->command);
+  } else {
+    FinishFlashCommand(chip);
+  }
+}
+/**
+ * Does whatever's due on each chip and starts anything that's waiting,
+ * then sets TMR32B1 going for whatever's next. Always called with the
+ * interrupts disabled.
+ */
+static void RunFlashQueues(void) {
+  struct flash_chip* chip;
+  uint32_t elapsed, next = 0;
+  uint8_t n, progress;
+
+  /* A callback queued something. We'll get to it on the way out */
+  if (flash_queues_running) { return; }
+  flash_queues_running = 1;
+
+  elapsed = StopFlashTimer();
+  for (n = 0; n < FLASH_MAX_CHIPS; n++) {
+    chip = &flash_chips[n];
+    if (chip->state == FLASHCHIP_TIMED) {
+      chip->ticks = (chip->ticks > elapsed) ? chip->ticks - elapsed : 0;
+    }
+  }
+
+  do {
+    progress = 0;
+
+    for (n = 0; n < FLASH_MAX_CHIPS; n++) {
+      chip = &flash_chips[n];
+#ifdef FLASH_HARDWARE_BUSY
+      if (busy_pin_held) { break; } /* We'll be back when RY/BY# goes high */
+#endif
+
+      if (chip->state == FLASHCHIP_TIMED && chip->ticks == 0) {
+	ServiceFlashChip(chip);
+	progress = 1;
+      } else if (chip->state == FLASHCHIP_IDLE && chip->count > 0 &&
+		 (chip->queue[chip->head].command != FLASHQ_AUTO_WRITE ||
+		  chip->part.page_size || writeflash_active == WRITEFLASH_INACTIVE)) {
+	StartFlashCommand(chip);
+	progress = 1;
+      }
+    }
 
-  LPC_CT32B1->TCR = 0x2; /* Put the timer into reset */
-
-  /* If there's a buffer being written out at the moment */
-  if (writeflash_active == WRITEFLASH_ACTIVE) {
-    /* Write out another two bytes from the buffer */
-    ChipSelectFlash(writeflash_address, FLASH_SSEL_ENABLE);
-    spi_write(FLASH_AUTO_WRITE);
-    spi_write(writeflash_record[writeflash_index++]);
-    spi_write(writeflash_record[writeflash_index++]);
-    spi_dump_bytes(3);
-    ChipSelectFlash(writeflash_address, FLASH_SSEL_DISABLE);
-
-    /* If we've reached the end of this record */
-    if (writeflash_index >= writeflash_len) {
-      /* We've finished writing out. Set the flag */
-      writeflash_active = WRITEFLASH_FINISHING; /* Finishing */
+#ifdef FLASH_HARDWARE_BUSY
+    /* The other chips have had their turn, now carry on writing */
+    if (!busy_pin_held && writeflash_active != WRITEFLASH_INACTIVE) {
+      ContinueAutoWrite(&flash_chips[writeflash_address >> 24]);
+      progress = 1;
+    }
+#endif
+  } while (progress);
+
+  for (n = 0; n < FLASH_MAX_CHIPS; n++) {
+    chip = &flash_chips[n];
+    if (chip->state == FLASHCHIP_TIMED && chip->ticks > 0 &&
+	(next == 0 || chip->ticks < next)) {
+      next = chip->ticks;
     }
+  }
 
-    /* Start the timer */
-    LPC_CT32B1->TCR = 0x1;
-  } else { /* We're Done */
+  if (next > 0) {
+    StartFlashTimer(next);
+  } else {
     EndWriteFlash();
-    writeflash_active = WRITEFLASH_INACTIVE; /* Inactive */
   }
+
+  flash_queues_running = 0;
+}
+/**
+ * Runs the queues from wherever we are. The interrupts can't get in if
+ * we're already in a higher priority interrupt, or if they'd be
+ * waiting for us anyway, so anything that waits on the queues calls
+ * this.
+ */
+void StepFlashQueue(void) {
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+#ifdef FLASH_HARDWARE_BUSY
+  if (busy_pin_held) {
+    NVIC_ClearPendingIRQ(PIOINT0_IRQn);
+    PIOINT0_IRQHandler();
+  } else
+#endif
+  if (flash_timer_ticks > 0 && (LPC_CT32B1->IR & 1)) {
+    NVIC_ClearPendingIRQ(TIMER_32_1_IRQn);
+    TIMER32_1_IRQHandler();
+  }
+  __set_PRIMASK(primask);
 }
-void EndWriteFlash() {
-  /* Disable the interrupt */
-  NVIC_DisableIRQ(TIMER_32_1_IRQn);
+static void QueueFlashCommand(struct flash_command* command) {
+  struct flash_chip* chip;
+  uint32_t primask;
 
-  LPC_SYSCON->SYSAHBCLKCTRL &= ~(1 << 10); /* Disconnect the clock from TMR32B1 */
+  if ((command->address >> 24) >= FLASH_MAX_CHIPS) { return; } /* No such chip */
+  chip = &flash_chips[command->address >> 24];
 
-  /* Exit the auto write mode */
-  SingleCommand(writeflash_address, FLASH_WRITE_DISABLE);
+  /* Wait for a space in the queue */
+  while (chip->count >= FLASH_QUEUE_LENGTH) {
+    StepFlashQueue();
+  }
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+  chip->queue[(chip->head + chip->count) % FLASH_QUEUE_LENGTH] = *command;
+  chip->count++;
+  if (chip->state == FLASHCHIP_IDLE) { /* Start it if we can */
+    RunFlashQueues();
+  }
+  __set_PRIMASK(primask);
+}
+/**
+ * Queues a single byte write.
+ */
+void StartWriteFlashByte(uint32_t address, uint8_t data, flash_callback callback) {
+  struct flash_command command = {
+    .command = FLASHQ_BYTE_WRITE, .address = address, .value = data, .callback = callback,
+  };
+
+  QueueFlashCommand(&command);
+}
+/**
+ * Queues the erase of a 4 KByte sector.
+ */
+void StartSectorErase(uint32_t address, flash_callback callback) {
+  struct flash_command command = {
+    .command = FLASHQ_SECTOR_ERASE, .address = address, .callback = callback,
+  };
+
+  QueueFlashCommand(&command);
+}
+/**
+ * Queues the erase of a 64 KByte page.
+ */
+void StartPageErase(uint32_t address, flash_callback callback) {
+  struct flash_command command = {
+    .command = FLASHQ_PAGE_ERASE, .address = address, .callback = callback,
+  };
+
+  QueueFlashCommand(&command);
+}
+/**
+ * Queues the erase of a whole chip.
+ */
+void StartChipErase(uint32_t address, flash_callback callback) {
+  struct flash_command command = {
+    .command = FLASHQ_CHIP_ERASE, .address = address, .callback = callback,
+  };
+
+  QueueFlashCommand(&command);
+}
+/**
+ * Queues a wait for the chip's busy bit to clear. Useful just for the
+ * callback.
+ */
+void StartWaitForBusyClear(uint32_t address, flash_callback callback) {
+  struct flash_command command = {
+    .command = FLASHQ_WAIT, .address = address, .callback = callback,
+  };
+
+  QueueFlashCommand(&command);
+}
+/**
+ * Returns non-zero if the chip has anything queued.
+ */
+uint8_t FlashChipBusy(uint32_t address) {
+  if ((address >> 24) >= FLASH_MAX_CHIPS) { return 0; }
+
+  return flash_chips[address >> 24].count > 0;
+}
+/**
+ * Blocks until everything queued for the chip has completed.
+ */
+void WaitForFlashChip(uint32_t address) {
+  while (FlashChipBusy(address)) {
+    StepFlashQueue();
+  }
+}
+/**
+ * Blocks until any automatic write has finished. With
+ * FLASH_HARDWARE_BUSY the chip is held selected while it's waiting on
+ * RY/BY#, so nothing else can use the bus.
+ */
+void WaitForAutoWrite(void) {
+  while (writeflash_active != WRITEFLASH_INACTIVE) {
+    StepFlashQueue();
+  }
+}
+/**
+ * Blocks until everything in every queue has completed.
+ */
+void WaitForFlashQueue(void) {
+  uint8_t n;
+
+  for (n = 0; n < FLASH_MAX_CHIPS; n++) {
+    WaitForFlashChip(n << 24);
+  }
+}
+/**
+ * Waits for the chip's queue to empty, then keeps the interrupts off
+ * so nothing new can be started on it, or take the bus, until the
+ * caller's done. Returns the interrupt state to put back afterwards.
+ */
+static uint32_t ClaimFlashChip(uint32_t address) {
+  uint32_t primask;
+
+  WaitForFlashChip(address); /* The long waits are done with the interrupts on */
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+#ifdef FLASH_HARDWARE_BUSY
+  while (FlashChipBusy(address) || busy_pin_held) {
+#else
+  while (FlashChipBusy(address)) {
+#endif
+    StepFlashQueue();
+  }
+
+  return primask;
+}
+/**
+ * For anything else on the SPI bus, like the radio. Waits for the
+ * flash to let go of the bus, then keeps the interrupts off so the
+ * queues can't take it back until the caller's done. Returns the
+ * interrupt state to put back afterwards.
+ */
+uint32_t ClaimSharedBus(void) {
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+#ifdef FLASH_HARDWARE_BUSY
+  while (busy_pin_held) { /* The chip's selected and P0[8] isn't MISO */
+    StepFlashQueue();
+  }
+#endif
+
+  return primask;
 }
 
 /* ---- LOCATION HELPERS ---- */
@@ -310,20 +1171,32 @@ void EndWriteFlash() {
 /**
  * Advances to the next chip.
  * If wrap is 0 and there are no more chips left this function returns 0xFFFFFFFF.
+ * It also does if there are no chips at all.
  */
 uint32_t NextChip(uint32_t address, uint8_t wrap) {
   uint8_t chip = (address>>24) & 0xFF; /* Work out which chip we're in */
-
-  do {
-    address = ((address & 0xFF000000) + 0x01000000); chip++;
-    /* If we've wrapped when wrapping is disabled */
-    if (chip == 0 && wrap == NO_WRAP) {
-      return 0xFFFFFFFF; /* No more chips remaining */
+  uint8_t i;
+
+  for (i = 0; i < FLASH_MAX_CHIPS; i++) {
+    chip++;
+    if (chip >= FLASH_MAX_CHIPS) {
+      /* If we've wrapped when wrapping is disabled */
+      if (wrap == NO_WRAP) {
+	return 0xFFFFFFFF; /* No more chips remaining */
+      }
+      chip = 0;
+    }
+    if (flash_sizes[chip] != 0) {
+      return (uint32_t)chip << 24;
     }
-  } while (flash_sizes[chip] == 0);
+  }
 
-  return address;
+  return 0xFFFFFFFF;
 }
+/**
+ * Advances to the next 64 KByte page, wrapping around the chips.
+ * Returns 0xFFFFFFFF if there are no chips.
+ */
 uint32_t NextPage(uint32_t address) {
   /* Move along the memory by one page */
   address = (address & 0xFFFF0000) + 0x00010000;
@@ -332,9 +1205,9 @@ uint32_t NextPage(uint32_t address) {
   uint32_t index = address & 0xFFFFFF; /* And our position within this chip */
 
   /* If we've gone over the edge of this chip */
-  while (index >= flash_sizes[chip]) {
+  if (chip >= FLASH_MAX_CHIPS || index >= flash_sizes[chip]) {
     /* Go to the next chip or wrap around the chips */
-    address = ((address & 0xFF000000) + 0x01000000); index = 0; chip++;
+    return NextChip(address, WRAP);
   }
 
   return address;
@@ -346,34 +1219,44 @@ uint32_t NextPage(uint32_t address) {
  * Erases a 4 KByte sector. Remember this may take up to 30ms.
  */
 void SectorErase(uint32_t address) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   if (WriteUnprotect(address) > 0) { /* If write enable was successful */
     SingleCommand(address, FLASH_WRITE_ENABLE);
 
     __NOP();
 
     ChipSelectFlash(address, FLASH_SSEL_ENABLE);
-    WriteCommandAddress(FLASH_4KB_ERASE, address); spi_dump_bytes(4);
+    WriteCommandAddress(FlashPart(address)->sector_erase, address); spi_dump_bytes(4);
     ChipSelectFlash(address, FLASH_SSEL_DISABLE);
   }
+
+  __set_PRIMASK(primask);
 }
 /**
  * Erases a 64 KByte page. Remember this may take up to 30ms.
  */
 void PageErase(uint32_t address) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   if (WriteUnprotect(address) > 0) { /* If write enable was successful */
     SingleCommand(address, FLASH_WRITE_ENABLE);
 
     __NOP();
 
     ChipSelectFlash(address, FLASH_SSEL_ENABLE);
-    WriteCommandAddress(FLASH_64KB_ERASE, address); spi_dump_bytes(4);
+    WriteCommandAddress(FlashPart(address)->block_erase, address); spi_dump_bytes(4);
     ChipSelectFlash(address, FLASH_SSEL_DISABLE);
   }
+
+  __set_PRIMASK(primask);
 }
 /**
  * Erases a whole chip. Remember this may take up to 60ms.
  */
 void ChipErase(uint32_t address) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   if (WriteUnprotect(address) > 0) { /* If write enable was successful */
     SingleCommand(address, FLASH_WRITE_ENABLE);
 
@@ -381,16 +1264,34 @@ void ChipErase(uint32_t address) {
 
     SingleCommand(address, FLASH_CHIP_ERASE);
   }
+
+  __set_PRIMASK(primask);
 }
 
 /* ---- STATUS REGISTERS AND WRITE PROTECTION ---- */
 
 void WriteProtect(uint32_t address) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   WriteStatusRegister(address, 0x1C);
+  __set_PRIMASK(primask);
 }
+/**
+ * Clears the block protection bits so the chip can be written. The
+ * bits stay clear until the chip is reset or protected again, so we
+ * only go to the chip the first time.
+ */
 uint8_t WriteUnprotect(uint32_t address) {
+  uint8_t chip = address >> 24;
+
+  if (chip < FLASH_MAX_CHIPS && flash_chips[chip].unprotected) {
+    return 0xFF; /* Nothing's changed since last time */
+  }
+
   if ((ReadFlashStatus(address) & 0x80) == 0) {
-    WriteStatusRegister(address, 0); return 0xFF;
+    WriteStatusRegister(address, 0);
+    if (chip < FLASH_MAX_CHIPS) { flash_chips[chip].unprotected = 1; }
+    return 0xFF;
   } else {
     debug_puts("Chip is locked from any further writes. Send !WP! high or reset."); return 0;
   }
@@ -399,7 +1300,10 @@ uint8_t WriteUnprotect(uint32_t address) {
  * Locks the chip from any further writes (until !WP! goes high or a reset)
  */
 void WriteLock(uint32_t address) {
+  uint32_t primask = ClaimFlashChip(address); /* The chip has to be free */
+
   WriteStatusRegister(address, 0x80 | 0x1C);
+  __set_PRIMASK(primask);
 }
 
 uint8_t ReadFlashStatus(uint32_t address) {
@@ -411,6 +1315,10 @@ uint8_t ReadFlashStatus(uint32_t address) {
   return result;
 }
 void WriteStatusRegister(uint32_t address, uint8_t status) {
+  if ((address >> 24) < FLASH_MAX_CHIPS) { /* Anything could be protected now */
+    flash_chips[address >> 24].unprotected = 0;
+  }
+
   SingleCommand(address, FLASH_WRITE_ENABLE);
 
   __NOP();
@@ -448,6 +1356,12 @@ void SingleCommand(uint32_t address, uint8_t command) {
 void SetFlashReset(uint8_t state) {
   /* Reduce the input to binary */
   uint8_t value = state > 0 ? 1 : 0;
+  uint8_t i;
+
+  /* The chips come out of reset protected */
+  for (i = 0; i < FLASH_MAX_CHIPS; i++) {
+    flash_chips[i].unprotected = 0;
+  }
 
   /* Flash Reset is on P0[3] */
   LPC_GPIO0->MASKED_ACCESS[1<<3] = (value<<3);
@@ -461,6 +1375,7 @@ void ChipSelectFlash(uint32_t address, uint8_t state) {
   uint8_t value = (state == FLASH_SSEL_ENABLE) ? 0 : 1;
 
   if (state == FLASH_SSEL_ENABLE) {
+    chip_select_primask = __get_PRIMASK();
     __disable_irq();
 
     /* Use the SPI bus for flash. */
@@ -468,23 +1383,16 @@ void ChipSelectFlash(uint32_t address, uint8_t state) {
   }
 
   /* The top 8 bits of the address are the chip specifier */
-  switch (address & 0xFF000000) {
-    case 0x00000000:
-      LPC_GPIO1->MASKED_ACCESS[1<<7] = (value<<7);
-      break;
-    case 0x01000000:
-      LPC_GPIO2->MASKED_ACCESS[1<<0] = (value<<0);
-      break;
-    case 0x02000000:
-      LPC_GPIO1->MASKED_ACCESS[1<<8] = (value<<8);
-      break;
-    default: break;
+  if ((address >> 24) < FLASH_MAX_CHIPS) {
+    const struct flash_socket* socket = &flash_sockets[address >> 24];
+    socket->port->MASKED_ACCESS[1<<socket->pin] = (value<<socket->pin);
   }
 
   if (state != FLASH_SSEL_ENABLE) {
     /* Revert the SPI bus to working for the radio. */
     radio_spi_init();
 
-    __enable_irq();
+    /* Put the interrupts back how they were */
+    __set_PRIMASK(chip_select_primask);
   }
 }
@@ -21,30 +21,183 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
-
+#include <stdlib.h>
+#include <string.h>
 #include "mem/btree.h"
 #include "mem/checksum.h"
 #include "mem/flash.h"
+#include "mem/record.h"
+#include "mem/invalidate.h"
 #include "console.h"
 
-uint32_t check_block[RECORD_SIZE/4];
+uint32_t check_block[FULL_RECORD_SIZE/4];
 
+/**
+ * The acked leaves waiting to be invalidated, in a run of
+ * INVALIDATE_BATCH_LEAVES from batch_addr
+ */
+uint32_t batch_addr = 0xFFFFFFFF;
+uint8_t batch_pending[INVALIDATE_BATCH_LEAVES/8];
+
+/**
+ * The leaves that have been acked in the radio interrupt, waiting to
+ * be added to the batch. Writes are only started from main context,
+ * so an automatic write never holds the bus under the radio.
+ */
+struct acked_leaves acked_queue[ACKED_QUEUE_LENGTH];
+volatile uint8_t acked_head = 0, acked_count = 0;
+uint32_t acks_dropped = 0;
+
+/**
+ * What's being written out for the last batch. The write's queued, so
+ * this has to stay put until it's done.
+ */
+uint8_t batch_buffer[INVALIDATE_BATCH_LEAVES];
+volatile uint8_t batch_writing = 0;
+
+/**
+ * Returns 1 if the address is a leaf, so not in a root or the data.
+ */
+static uint8_t is_leaf(uint32_t leaf_addr) {
+  return (leaf_addr & 0x0000F000) && (leaf_addr & 0x000F0000) == 0;
+}
 /**
  * Invalidates a leaf so the corresponding record can be erased and
  * then overwritten in the future.
  */
 void invalidate(uint32_t leaf_addr) {
   /* If we're not in the root and we're not in the data */
-  if ((leaf_addr & 0x0000F000) && (leaf_addr & 0x000F0000) == 0) {
-    /* Invalidate the leaf */
-    WriteFlashByte(leaf_addr, 0);
+  if (is_leaf(leaf_addr)) {
+    /* Invalidate the leaf. This is queued, so acks don't hold up the radio */
+    StartWriteFlashByte(leaf_addr, 0, NULL);
+    /* The rest of its branch might be invalid now */
+    mark_for_reclaim(leaf_addr);
   } else {
     console_puts("Warning: Attempt to invalidate something that is not a leaf blocked.");
   }
 }
+/**
+ * Called once the batch has been written out.
+ */
+static void batch_written(uint32_t address) {
+  (void)address;
+
+  batch_writing = 0;
+}
+/**
+ * Writes out the batch of invalidations in one automatic write. Any
+ * leaf that's stopped being valid since it was acked is left alone, in
+ * case its branch has been erased and reused since.
+ */
+static void write_batch(void) {
+  uint8_t first = INVALIDATE_BATCH_LEAVES, last = 0, i, pending;
+
+  for (i = 0; i < INVALIDATE_BATCH_LEAVES; i++) {
+    if (batch_pending[i >> 3] & (1 << (i & 7))) {
+      if (first > i) { first = i; }
+      last = i;
+    }
+  }
+  if (first > last) { return; } /* Nothing to do */
+
+  /**
+   * The automatic write works in whole words. Writing 0xFF leaves a
+   * byte as it was, so we pad with that.
+   */
+  first &= ~1; last |= 1;
+
+  /* The buffer might still be in use by the last batch */
+  while (batch_writing) {
+    StepFlashQueue();
+  }
+
+  /* Work out what to write from the leaves as they are now */
+  ReadFlash(batch_addr + first, batch_buffer, last - first + 1);
+  for (i = first; i <= last; i++) {
+    pending = batch_pending[i >> 3] & (1 << (i & 7));
+    batch_buffer[i - first] =
+      (pending && batch_buffer[i - first] == LEAF_VALID) ? LEAF_INVALID : 0xFF;
+  }
+
+  batch_writing = 1;
+  StartWriteFlash(batch_addr + first, batch_buffer, last - first + 1, batch_written);
+  /* The rest of its branch might be invalid now */
+  mark_for_reclaim(batch_addr);
+
+  memset(batch_pending, 0, sizeof(batch_pending));
+  batch_addr = 0xFFFFFFFF;
+}
+/**
+ * Adds a leaf to the batch to be invalidated. If it's not in the same
+ * run as the others, they're written out first.
+ */
+static void batch_invalidate(uint32_t leaf_addr) {
+  uint32_t index;
+
+  if (!is_leaf(leaf_addr)) {
+    console_puts("Warning: Attempt to invalidate something that is not a leaf blocked.");
+    return;
+  }
+
+  if ((leaf_addr & ~(INVALIDATE_BATCH_LEAVES - 1)) != batch_addr) {
+    write_batch();
+    batch_addr = leaf_addr & ~(INVALIDATE_BATCH_LEAVES - 1);
+  }
+
+  index = leaf_addr - batch_addr;
+  batch_pending[index >> 3] |= 1 << (index & 7);
+}
+/**
+ * Called from the radio interrupt with leaves that have been acked.
+ * If the queue's full they're left valid, and will be uploaded again.
+ */
+static void queue_acked(uint32_t leaf_addr, uint8_t bitmap) {
+  struct acked_leaves* acked;
+
+  if (acked_count >= ACKED_QUEUE_LENGTH) { acks_dropped++; return; }
+
+  acked = &acked_queue[(acked_head + acked_count) % ACKED_QUEUE_LENGTH];
+  acked->leaf = leaf_addr;
+  acked->bitmap = bitmap;
+  acked_count++;
+}
+/**
+ * Adds the leaves that have been acked to the batch. Runs that are
+ * done with are written out as we go, but the last one is kept open.
+ * Call this from main context only.
+ */
+void collect_invalidations(void) {
+  struct acked_leaves acked;
+  uint32_t primask;
+  uint8_t bit;
+
+  while (acked_count > 0) {
+    primask = __get_PRIMASK();
+    __disable_irq();
+    acked = acked_queue[acked_head];
+    acked_head = (acked_head + 1) % ACKED_QUEUE_LENGTH;
+    acked_count--;
+    __set_PRIMASK(primask);
+
+    for (bit = 0; bit < 8; bit++) {
+      if (acked.bitmap & (1 << bit)) {
+	batch_invalidate(acked.leaf + bit);
+      }
+    }
+  }
+}
+/**
+ * Writes out everything that's been acked. Call this from main
+ * context only.
+ */
+void flush_invalidations(void) {
+  collect_invalidations();
+  write_batch();
+}
 /**
  * Checks if the record corresponding to the leaf address specified
- * matches the checksum given, and if so invalidates the leaf.
+ * matches the checksum given, and if so queues the leaf up to be
+ * invalidated.
  */
 void check_and_invalidate(uint32_t leaf_addr, uint32_t radio_checksum) {
   uint32_t checksum;
@@ -55,13 +208,60 @@ void check_and_invalidate(uint32_t leaf_addr, uint32_t radio_checksum) {
 
   /* Checksum matches, all good */
   if (checksum == radio_checksum) {
-    invalidate(leaf_addr);
+    queue_acked(leaf_addr, 1);
   } else { /* It doesn't match! */
     /* Read in this block */
-    ReadFlash(record_addr, (uint8_t*)check_block, RECORD_SIZE);
+    read_full_record(leaf_addr, check_block);
     /* If the checksum is wrong, invalidate the block */
     if (evaluate_checksum((uint8_t*)check_block) == CHECKSUM_FAIL) {
-      invalidate(leaf_addr);
+      queue_acked(leaf_addr, 1);
+    }
+  }
+}
+/**
+ * Checks the records for the leaves in the bitmap, counting on from
+ * leaf_addr, against the sum of their checksums. If it matches they're
+ * all queued up to be invalidated. Otherwise we can't tell
+ * which one's wrong, so only those that fail their own checksum are.
+ */
+void check_and_invalidate_bitmap(uint32_t leaf_addr, uint8_t bitmap,
+				 uint32_t radio_checksum) {
+  struct flash_stream stream;
+  uint32_t checksum, sum = 0;
+  uint8_t bit;
+
+  /* Leaves past the end of the branch don't exist */
+  for (bit = 0; bit < 8; bit++) {
+    if (((leaf_addr & 0xFFF) + bit) >= MAX_RECORDS_PER_BRANCH) {
+      bitmap &= ~(1 << bit);
+    }
+  }
+  if (bitmap == 0) { return; }
+
+  /* The records are next to each other, so they're read in one go */
+  OpenFlashStream(&stream, leaf_addr_to_record_addr(leaf_addr));
+  for (bit = 0; bit < 8; bit++) {
+    if (bitmap & (1 << bit)) {
+      SeekFlashStream(&stream, leaf_addr_to_record_addr(leaf_addr + bit));
+      ReadFlashStream(&stream, (uint8_t*)check_block, RECORD_SIZE);
+      memcpy(&checksum, (uint8_t*)check_block + (RECORD_SIZE - 4), 4);
+      sum += checksum;
     }
   }
+  CloseFlashStream(&stream);
+
+  if (sum != radio_checksum) {
+    for (bit = 0; bit < 8; bit++) {
+      if (bitmap & (1 << bit)) {
+	/* Read in this block */
+	read_full_record(leaf_addr + bit, check_block);
+	/* Unless the checksum is wrong, keep the block */
+	if (evaluate_checksum((uint8_t*)check_block) != CHECKSUM_FAIL) {
+	  bitmap &= ~(1 << bit);
+	}
+      }
+    }
+  }
+
+  if (bitmap) { queue_acked(leaf_addr, bitmap); }
 }
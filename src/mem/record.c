@@ -0,0 +1,354 @@
+/* 
+ * Converts records between their stored and full layouts
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "LPC11xx.h"
+#include <stdlib.h>
+#include "mem/btree.h"
+#include "mem/flash.h"
+#include "mem/record.h"
+
+/**
+ * A full record is structured as follows:
+ *
+ * WORD NR	USE
+ * 0:		RECORD_FLAGS
+ * 1: 		UNIX_TIME LSB
+ * 2: 		UNIX_TIME MSB
+ * 3: 		LEFT CHANNEL READING
+ * 4:		RIGHT CHANNEL READING
+ * 5:		CHECKSUM
+ *
+ * This is what gets checksummed and uploaded. Without COMPACT_RECORDS
+ * it's also exactly what's stored in memory.
+ *
+ * With COMPACT_RECORDS each page starts with a branch header:
+ *
+ * WORD NR	USE
+ * 0:		BRANCH_HEADER_MAGIC
+ * 1:		TIME BASE LSB
+ * 2:		TIME BASE MSB
+ * 3-18:	RECORD_FLAGS TABLE
+ *
+ * And each record stored in the page is then:
+ *
+ * WORD NR	USE
+ * 0:		TIME DELTA (bits 0-23), FLAGS TABLE INDEX (bits 24-30),
+ *		DELTA IS BEFORE THE TIME BASE (bit 31)
+ * 1:		LEFT CHANNEL READING
+ * 2:		RIGHT CHANNEL READING
+ * 3:		CHECKSUM (of the full record)
+ *
+ * The checksum is always calculated on the full record, so the base
+ * station sees exactly the same uploads and acks in either layout.
+ */
+
+#ifdef COMPACT_RECORDS
+
+enum {
+  /**
+   * "VLF" followed by the layout version.
+   */
+  BRANCH_HEADER_MAGIC	= 0x02464C56,
+  /**
+   * The number of different record flags one branch can hold.
+   */
+  BRANCH_FLAG_SLOTS	= 16,
+  /**
+   * The time base is set this many seconds before the first record on
+   * a branch, so records that are from a little while ago still fit.
+   */
+  BRANCH_TIME_SLACK	= 0x1000,
+  /**
+   * The largest time delta a record can store. About 194 days.
+   */
+  MAX_TIME_DELTA	= 0xFFFFFF,
+  /**
+   * Set with the flags table index when a record's from before the
+   * time base. The clock can be set back after a branch is started,
+   * and we'd rather keep filling the branch than leave it.
+   */
+  SLOT_BEFORE_BASE	= 0x80,
+};
+
+struct branch_header {
+  uint32_t magic;
+  uint32_t time_low;
+  uint32_t time_high;
+  uint32_t flags[BRANCH_FLAG_SLOTS];
+};
+
+struct header_copy {
+  struct branch_header header;
+  uint32_t addr;
+};
+
+/**
+ * Copies of the header for the page at addr. The radio interrupt reads
+ * records to check acks, so it has its own copy rather than loading
+ * one over ours while we're using it.
+ */
+struct header_copy main_header = { .addr = 0xFFFFFFFF };
+struct header_copy isr_header = { .addr = 0xFFFFFFFF };
+
+/**
+ * What's being written to a header. The writes are queued, so this
+ * has to stay put until they're done.
+ */
+uint32_t header_writes[4];
+
+/**
+ * Returns the copy of the header for wherever we're being called from.
+ */
+static struct header_copy* header_copy(void) {
+  return (__get_IPSR() == 0) ? &main_header : &isr_header;
+}
+/**
+ * Makes sure the copy has the header for the given page.
+ */
+static void load_branch_header(struct header_copy* copy, uint32_t page_addr) {
+  if (copy->addr != page_addr) {
+    ReadFlash(page_addr, (uint8_t*)&copy->header, sizeof(struct branch_header));
+    copy->addr = page_addr;
+  }
+}
+static uint64_t get_time_base(struct header_copy* copy) {
+  return ((uint64_t)copy->header.time_high << 32) | copy->header.time_low;
+}
+/**
+ * Returns the time of a record from the first word of its packed form.
+ */
+static uint64_t packed_time(struct header_copy* copy, uint32_t word) {
+  if ((word >> 24) & SLOT_BEFORE_BASE) {
+    return get_time_base(copy) - (word & MAX_TIME_DELTA);
+  }
+  return get_time_base(copy) + (word & MAX_TIME_DELTA);
+}
+
+#endif
+
+/**
+ * Packs a full record into the layout we store in memory, ready to be
+ * written to record_addr. This may extend the branch header, in which
+ * case it waits for that write to finish. Otherwise it doesn't touch
+ * the flash if it already has the header.
+ *
+ * Returns 0 if the record can't be stored on this branch (it's more than
+ * MAX_TIME_DELTA either side of the time base or the flags table is
+ * full), in which case another branch should be tried.
+ */
+uint8_t pack_record(uint32_t record_addr, uint32_t* full, uint32_t* packed) {
+#ifdef COMPACT_RECORDS
+  uint32_t page_addr = record_addr & 0xFFFF0000;
+  uint64_t time = ((uint64_t)full[2] << 32) | full[1];
+  struct header_copy* copy = header_copy();
+  struct header_copy* other = (copy == &main_header) ? &isr_header : &main_header;
+  struct branch_header* header = &copy->header;
+  uint8_t slot, header_written = 0;
+  uint32_t delta;
+
+  load_branch_header(copy, page_addr);
+
+  if (header->magic == 0xFFFFFFFF) { /* This is a fresh branch */
+    uint64_t base = (time > BRANCH_TIME_SLACK) ? time - BRANCH_TIME_SLACK : 0;
+
+    header->magic = header_writes[0] = BRANCH_HEADER_MAGIC;
+    header->time_low = header_writes[1] = (uint32_t)base;
+    header->time_high = header_writes[2] = (uint32_t)(base >> 32);
+    StartWriteFlash(page_addr, (uint8_t*)header_writes, 3*4, NULL);
+    header_written = 1;
+  } else if (header->magic != BRANCH_HEADER_MAGIC) {
+    return 0; /* Not a header we understand */
+  }
+
+  /* Make sure the time fits in a delta, either side of the base */
+  if (time >= get_time_base(copy)) {
+    delta = (time - get_time_base(copy) > MAX_TIME_DELTA) ? 0xFFFFFFFF :
+      (uint32_t)(time - get_time_base(copy));
+  } else {
+    delta = (get_time_base(copy) - time > MAX_TIME_DELTA) ? 0xFFFFFFFF :
+      (uint32_t)(get_time_base(copy) - time) | ((uint32_t)SLOT_BEFORE_BASE << 24);
+  }
+  if (delta == 0xFFFFFFFF) {
+    if (header_written) { WaitForFlashChip(page_addr); }
+    return 0;
+  }
+
+  /* Find these flags in the table, or claim an empty slot for them */
+  for (slot = 0; slot < BRANCH_FLAG_SLOTS; slot++) {
+    if (header->flags[slot] == full[0]) { break; }
+    if (header->flags[slot] == 0xFFFFFFFF) {
+      header->flags[slot] = header_writes[3] = full[0];
+      StartWriteFlash(page_addr + 3*4 + slot*4, (uint8_t*)&header_writes[3], 4, NULL);
+      header_written = 1;
+      break;
+    }
+  }
+
+  /**
+   * Any header writes must be done before the leaf is marked, and
+   * before header_writes is used again. The other copy might be from
+   * before them.
+   */
+  if (header_written) {
+    WaitForFlashChip(page_addr);
+    if (other->addr == page_addr) { other->addr = 0xFFFFFFFF; }
+  }
+
+  if (slot == BRANCH_FLAG_SLOTS) { /* The flags table is full */
+    return 0;
+  }
+
+  packed[0] = delta | (slot << 24);
+  packed[1] = full[3];
+  packed[2] = full[4];
+  packed[3] = full[5];
+#else
+  uint8_t i;
+  (void)record_addr;
+
+  for (i = 0; i < RECORD_SIZE/4; i++) {
+    packed[i] = full[i];
+  }
+#endif
+  return 1;
+}
+#ifdef COMPACT_RECORDS
+/**
+ * Expands a packed record into a full record, using the copy of the
+ * header that's been loaded for its page.
+ */
+static void expand_record(struct header_copy* copy, uint32_t* packed, uint32_t* full) {
+  uint8_t slot = (packed[0] >> 24) & ~SLOT_BEFORE_BASE;
+  uint64_t time = packed_time(copy, packed[0]);
+
+  full[0] = (slot < BRANCH_FLAG_SLOTS) ? copy->header.flags[slot] : 0xFFFFFFFF;
+  full[1] = (uint32_t)time;
+  full[2] = (uint32_t)(time >> 32);
+  full[3] = packed[1];
+  full[4] = packed[2];
+  full[5] = packed[3];
+}
+#endif
+/**
+ * Reads the record that corresponds to the given leaf and expands it
+ * into a full record.
+ */
+void read_full_record(uint32_t leaf_addr, uint32_t* full) {
+  uint32_t record_addr = leaf_addr_to_record_addr(leaf_addr);
+#ifdef COMPACT_RECORDS
+  struct header_copy* copy = header_copy();
+  uint32_t packed[RECORD_SIZE/4];
+
+  ReadFlash(record_addr, (uint8_t*)packed, RECORD_SIZE);
+  load_branch_header(copy, record_addr & 0xFFFF0000);
+  expand_record(copy, packed, full);
+#else
+  ReadFlash(record_addr, (uint8_t*)full, RECORD_SIZE);
+#endif
+}
+/**
+ * Like read_full_record, but through a stream, so reading the records
+ * of consecutive leaves only sends the command and address once. The
+ * stream is closed if the branch header has to be read.
+ */
+void stream_full_record(struct flash_stream* stream, uint32_t leaf_addr, uint32_t* full) {
+  uint32_t record_addr = leaf_addr_to_record_addr(leaf_addr);
+#ifdef COMPACT_RECORDS
+  struct header_copy* copy = header_copy();
+  uint32_t packed[RECORD_SIZE/4];
+
+  if (copy->addr != (record_addr & 0xFFFF0000)) {
+    CloseFlashStream(stream);
+    load_branch_header(copy, record_addr & 0xFFFF0000);
+  }
+  SeekFlashStream(stream, record_addr);
+  ReadFlashStream(stream, (uint8_t*)packed, RECORD_SIZE);
+  expand_record(copy, packed, full);
+#else
+  SeekFlashStream(stream, record_addr);
+  ReadFlashStream(stream, (uint8_t*)full, RECORD_SIZE);
+#endif
+}
+/**
+ * Reads just the time of the record that corresponds to the given
+ * leaf.
+ */
+uint64_t read_record_time(uint32_t leaf_addr) {
+  uint32_t record_addr = leaf_addr_to_record_addr(leaf_addr);
+#ifdef COMPACT_RECORDS
+  struct header_copy* copy = header_copy();
+  uint32_t delta;
+
+  ReadFlash(record_addr, (uint8_t*)&delta, 4);
+  load_branch_header(copy, record_addr & 0xFFFF0000);
+
+  return packed_time(copy, delta);
+#else
+  uint32_t time[2];
+
+  ReadFlash(record_addr + 4, (uint8_t*)time, 8);
+
+  return ((uint64_t)time[1] << 32) | time[0];
+#endif
+}
+/**
+ * Reads just the flags of the record that corresponds to the given
+ * leaf.
+ */
+uint32_t read_record_flags(uint32_t leaf_addr) {
+  uint32_t record_addr = leaf_addr_to_record_addr(leaf_addr);
+#ifdef COMPACT_RECORDS
+  struct header_copy* copy = header_copy();
+  uint32_t delta;
+  uint8_t slot;
+
+  ReadFlash(record_addr, (uint8_t*)&delta, 4);
+  load_branch_header(copy, record_addr & 0xFFFF0000);
+
+  slot = (delta >> 24) & ~SLOT_BEFORE_BASE;
+
+  return (slot < BRANCH_FLAG_SLOTS) ? copy->header.flags[slot] : 0xFFFFFFFF;
+#else
+  uint32_t flags;
+
+  ReadFlash(record_addr, (uint8_t*)&flags, 4);
+
+  return flags;
+#endif
+}
+/**
+ * Called when a page is erased, so we don't keep using its old header.
+ */
+void forget_branch_header(uint32_t page_addr) {
+#ifdef COMPACT_RECORDS
+  if (main_header.addr == (page_addr & 0xFFFF0000)) {
+    main_header.addr = 0xFFFFFFFF;
+  }
+  if (isr_header.addr == (page_addr & 0xFFFF0000)) {
+    isr_header.addr = 0xFFFFFFFF;
+  }
+#else
+  (void)page_addr;
+#endif
+}
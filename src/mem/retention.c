@@ -0,0 +1,439 @@
+/* 
+ * Makes space for new records by decimating the oldest ones
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "mem/btree.h"
+#include "mem/checksum.h"
+#include "mem/flash.h"
+#include "mem/record.h"
+#include "mem/retention.h"
+#include "mem/time_index.h"
+#include "mem/write.h"
+#include "rollup.h"
+
+/**
+ * During a long radio outage the memory fills up with records that
+ * haven't been uploaded. Rather than drop new records, we take two
+ * old full branches and merge pairs of records with the same flags
+ * into one. The merged record is at the middle of the pair's
+ * times and has the mean of their readings, so two 64 second averages
+ * become one 128 second average. Roll-ups are from the end of the time
+ * they cover, so a merged one is from the end of the later one, and
+ * ranges keep the lower minimum and the higher maximum. Records of different kinds come at
+ * different rates, so a few are held back to keep the times in
+ * order. They're written to a fresh branch and the two old ones are
+ * erased, which frees up a branch. Merged records get merged again in
+ * time, and so on.
+ */
+
+/**
+ * Records waiting for the next one with the same flags
+ */
+uint32_t pending[RETENTION_PENDING][FULL_RECORD_SIZE/4];
+uint8_t pending_used[RETENTION_PENDING];
+/**
+ * Records ready to go out, which are put back in time order here
+ */
+uint32_t ready[RETENTION_READY][FULL_RECORD_SIZE/4];
+uint8_t ready_count;
+/**
+ * Records waiting to be written out, and the same packed
+ */
+uint32_t merged[WRITE_QUEUE_LENGTH][FULL_RECORD_SIZE/4];
+uint32_t merged_packed[WRITE_QUEUE_LENGTH*RECORD_SIZE/4];
+uint8_t merged_count;
+/**
+ * The fresh branch, and the next leaf on it
+ */
+uint32_t merged_branch;
+uint32_t merged_leaf;
+/**
+ * The latest time we've sent out
+ */
+uint64_t emitted_time;
+/**
+ * The record we're reading in
+ */
+uint32_t source[FULL_RECORD_SIZE/4];
+/**
+ * The two branches being decimated, and the next leaf to take from
+ * them. It's done a few leaves on each wake, so that no one wake takes
+ * long. decimate_leaf is 0xFFFFFFFF when nothing's being decimated.
+ */
+uint32_t decimating[2];
+uint32_t decimate_leaf = 0xFFFFFFFF;
+uint8_t decimate_index;
+
+static uint64_t full_record_time(uint32_t* full) {
+  return ((uint64_t)full[2] << 32) | full[1];
+}
+/**
+ * Writes out the records waiting in RAM.
+ */
+static void flush_merged(void) {
+  uint8_t i, count = 0;
+
+  for (i = 0; i < merged_count; i++) {
+    if (merged_leaf + count >= merged_branch + MAX_RECORDS_PER_BRANCH ||
+	pack_record(leaf_addr_to_record_addr(merged_leaf + count), merged[i],
+		    merged_packed + count*(RECORD_SIZE/4)) == 0) {
+      /* It doesn't fit on this branch */
+      retention_dropped++;
+      continue;
+    }
+    count++;
+  }
+
+  if (count > 0) {
+    /* The last flush of the queue might still be going */
+    wait_for_write_complete();
+    write_records(merged_leaf, merged_packed, count);
+    wait_for_write_complete();
+    merged_leaf = flush_end_leaf; /* After anything written again */
+  }
+  merged_count = 0;
+}
+/**
+ * Sends out the oldest record we're holding, whether it's ready or
+ * still pending. Anything pending that's older than everything ready
+ * can't wait any longer, or the times on the new branch would go
+ * backwards. A pending roll-up takes the time of the one it's merged
+ * with, so it can wait unless with_rollups is set. If it's gone
+ * further back than the time index allows by then, it's dropped.
+ */
+static void emit_oldest(uint8_t with_rollups) {
+  uint8_t i, oldest = 0xFF, is_pending = 0;
+  uint32_t* record;
+
+  for (i = 0; i < ready_count; i++) {
+    if (oldest == 0xFF || full_record_time(ready[i]) < full_record_time(ready[oldest])) {
+      oldest = i;
+    }
+  }
+  for (i = 0; i < RETENTION_PENDING; i++) {
+    if (pending_used[i] && (with_rollups || !IS_ROLLUP_RECORD(pending[i][0])) &&
+	(oldest == 0xFF ||
+	 full_record_time(pending[i]) < full_record_time(is_pending ? pending[oldest] : ready[oldest]))) {
+      oldest = i; is_pending = 1;
+    }
+  }
+  if (oldest == 0xFF) { return; } /* Nothing left */
+
+  record = is_pending ? pending[oldest] : ready[oldest];
+  if (full_record_time(record) + TIME_INDEX_SLACK < emitted_time) {
+    retention_dropped++;
+  } else {
+    memcpy(merged[merged_count++], record, FULL_RECORD_SIZE);
+    if (full_record_time(record) > emitted_time) {
+      emitted_time = full_record_time(record);
+    }
+  }
+  if (is_pending) {
+    pending_used[oldest] = 0;
+  } else {
+    memcpy(ready[oldest], ready[--ready_count], FULL_RECORD_SIZE);
+  }
+
+  if (merged_count >= WRITE_QUEUE_LENGTH) {
+    flush_merged();
+  }
+}
+static void make_ready(uint32_t* full) {
+  /* What goes out might be pending rather than ready */
+  while (ready_count >= RETENTION_READY) {
+    emit_oldest(0);
+  }
+  memcpy(ready[ready_count++], full, FULL_RECORD_SIZE);
+}
+/**
+ * Merges the record b into the record a.
+ */
+static void merge(uint32_t* a, uint32_t* b) {
+  uint64_t time = (full_record_time(a) + full_record_time(b)) / 2;
+
+  /* Roll-ups are from the end of the time they cover */
+  if (IS_ROLLUP_RECORD(a[0]) && full_record_time(b) > full_record_time(a)) {
+    time = full_record_time(b);
+  }
+
+  a[1] = (uint32_t)time;
+  a[2] = (uint32_t)(time >> 32);
+  if (IS_ROLLUP_RECORD(a[0]) && ROLLUP_STATISTIC(a[0]) != ROLLUP_MEAN) {
+    /* Minimum, maximum */
+    if (b[3] < a[3]) { a[3] = b[3]; }
+    if (b[4] > a[4]) { a[4] = b[4]; }
+  } else {
+    a[3] = (a[3] >> 1) + (b[3] >> 1) + (a[3] & b[3] & 1);
+    a[4] = (a[4] >> 1) + (b[4] >> 1) + (a[4] & b[4] & 1);
+  }
+  a[5] = calculate_checksum((uint8_t*)a);
+}
+/**
+ * Takes a record from an old branch. It's either merged with the last
+ * one with the same flags, or held on to until the next one comes
+ * along.
+ */
+static void take(uint32_t* full) {
+  uint8_t i;
+
+  for (i = 0; i < RETENTION_PENDING; i++) {
+    if (pending_used[i] && pending[i][0] == full[0]) {
+      merge(pending[i], full);
+      pending_used[i] = 0;
+      make_ready(pending[i]);
+      return;
+    }
+  }
+
+  for (i = 0; i < RETENTION_PENDING && pending_used[i]; i++);
+  while (i == RETENTION_PENDING) { /* Make room */
+    emit_oldest(1);
+    for (i = 0; i < RETENTION_PENDING && pending_used[i]; i++);
+  }
+  memcpy(pending[i], full, FULL_RECORD_SIZE);
+  pending_used[i] = 1;
+}
+/**
+ * Sends out everything still held.
+ */
+static void take_last(void) {
+  while (ready_count > 0) {
+    emit_oldest(1);
+  }
+  for (;;) {
+    uint8_t i;
+    for (i = 0; i < RETENTION_PENDING && !pending_used[i]; i++);
+    if (i == RETENTION_PENDING) { break; }
+    emit_oldest(1);
+  }
+
+  flush_merged();
+}
+/**
+ * Decimates the next few valid records on the branch we're taking from
+ * into the fresh branch, and returns 1 once we're at the end of it.
+ * Records that have already been uploaded are left behind. The leaves
+ * are read together, but a merged record can be written out at any
+ * point, so the records are read one by one.
+ */
+static uint8_t take_leaves(uint32_t branch) {
+  uint8_t leaves[RETENTION_LEAVES_AT_ONCE];
+  uint32_t count = branch + MAX_RECORDS_PER_BRANCH - decimate_leaf;
+  uint8_t i;
+
+  if (count > RETENTION_LEAVES_AT_ONCE) { count = RETENTION_LEAVES_AT_ONCE; }
+  ReadFlash(decimate_leaf, leaves, count);
+
+  for (i = 0; i < count; i++) {
+    if (leaves[i] == LEAF_VALID) {
+      read_full_record(decimate_leaf + i, source);
+      take(source);
+    }
+  }
+  decimate_leaf += count;
+
+  return decimate_leaf >= branch + MAX_RECORDS_PER_BRANCH;
+}
+/**
+ * Counts the erased branches, up to RETENTION_MIN_FREE_BRANCHES, and
+ * returns the first one in fresh. The branch the writer is on doesn't
+ * count.
+ */
+static uint8_t count_free_branches(uint32_t avoid, uint32_t* fresh) {
+  uint32_t tree, branch;
+  uint8_t count = 0;
+
+  *fresh = 0xFFFFFFFF;
+
+  for (tree = first_root(); tree != 0xFFFFFFFF; tree = next_root(tree, NO_WRAP)) {
+    for (branch = tree + 0x1000; branch < tree + 0x10000; branch += 0x1000) {
+      if (branch != avoid && ReadFlashByte(branch) == LEAF_ERASED) {
+	if (*fresh == 0xFFFFFFFF) { *fresh = branch; }
+	if (++count >= RETENTION_MIN_FREE_BRANCHES) { return count; }
+      }
+    }
+  }
+
+  return count;
+}
+/**
+ * Reads the time of the first record on a full branch, and how long
+ * it spans. Returns 0 if the branch isn't full.
+ */
+static uint8_t branch_span(uint32_t branch, uint64_t* first, uint64_t* span) {
+  /* Leaves are written in order, so the last one says if it's full */
+  if (ReadFlashByte(branch + MAX_RECORDS_PER_BRANCH - 1) == LEAF_ERASED) {
+    return 0;
+  }
+
+  *first = read_record_time(branch);
+  *span = read_record_time(branch + MAX_RECORDS_PER_BRANCH - 1) - *first;
+  return 1;
+}
+/**
+ * Each decimation doubles the time a branch spans, so the level is how
+ * many times that's happened compared with the finest branch we have.
+ */
+static uint8_t branch_level(uint64_t span, uint64_t finest) {
+  uint64_t limit = finest + finest / 2 + 1;
+  uint8_t level = 0;
+
+  while (span >= limit && level < RETENTION_LEVELS - 1) {
+    limit <<= 1; level++;
+  }
+
+  return level;
+}
+/**
+ * Picks the two branches to decimate. They're the two oldest full
+ * branches on whichever level has the most, so the levels stay about
+ * the same size and each holds about twice the time of the one before.
+ * Old records lose resolution a step at a time, rather than the
+ * oldest branch being decimated again and again.
+ */
+static void find_branches_to_decimate(uint32_t* oldest) {
+  uint32_t tree, branch;
+  uint64_t first, span, finest = UINT64_MAX, times[2];
+  uint16_t count[RETENTION_LEVELS];
+  uint8_t level, busiest = 0;
+
+  oldest[0] = oldest[1] = 0xFFFFFFFF;
+
+  /* Find the finest level */
+  for (tree = first_root(); tree != 0xFFFFFFFF; tree = next_root(tree, NO_WRAP)) {
+    for (branch = tree + 0x1000; branch < tree + 0x10000; branch += 0x1000) {
+      if (branch_span(branch, &first, &span) && span < finest) { finest = span; }
+    }
+  }
+  if (finest == UINT64_MAX) { return; } /* Nothing's full */
+
+  /* Then count the branches on each level */
+  for (level = 0; level < RETENTION_LEVELS; level++) { count[level] = 0; }
+  for (tree = first_root(); tree != 0xFFFFFFFF; tree = next_root(tree, NO_WRAP)) {
+    for (branch = tree + 0x1000; branch < tree + 0x10000; branch += 0x1000) {
+      if (branch_span(branch, &first, &span)) {
+	level = branch_level(span, finest);
+	if (++count[level] > count[busiest]) { busiest = level; }
+      }
+    }
+  }
+
+  /* And find the two oldest on the busiest */
+  times[0] = times[1] = UINT64_MAX;
+  for (tree = first_root(); tree != 0xFFFFFFFF; tree = next_root(tree, NO_WRAP)) {
+    for (branch = tree + 0x1000; branch < tree + 0x10000; branch += 0x1000) {
+      if (!branch_span(branch, &first, &span) || branch_level(span, finest) != busiest) {
+	continue;
+      }
+
+      if (first < times[0]) {
+	times[1] = times[0]; oldest[1] = oldest[0];
+	times[0] = first; oldest[0] = branch;
+      } else if (first < times[1]) {
+	times[1] = first; oldest[1] = branch;
+      }
+    }
+  }
+}
+/**
+ * Called with the writer's current leaf when it moves onto another
+ * branch. If the memory's nearly full, a decimation of two old full
+ * branches into a fresh one is started. decimate_some carries it on.
+ * It only happens once per branch's worth of records while nothing's
+ * being uploaded.
+ */
+void retain_space(uint32_t write_leaf) {
+  uint8_t i;
+
+  if (decimate_leaf != 0xFFFFFFFF) { return; } /* One's going already */
+
+  /* The queue might be about to go onto a branch we'd count as free */
+  flush_writes();
+  wait_for_write_complete();
+
+  if (count_free_branches(write_leaf & 0xFFFFF000, &merged_branch) >=
+      RETENTION_MIN_FREE_BRANCHES || merged_branch == 0xFFFFFFFF) {
+    return;
+  }
+
+  find_branches_to_decimate(decimating);
+  if (decimating[1] == 0xFFFFFFFF) { return; } /* Nothing to decimate */
+
+  activate_branch_on_root(merged_branch);
+  merged_leaf = merged_branch;
+  merged_count = ready_count = 0;
+  emitted_time = 0;
+  for (i = 0; i < RETENTION_PENDING; i++) { pending_used[i] = 0; }
+
+  decimate_index = 0;
+  decimate_leaf = decimating[0];
+}
+/**
+ * Carries on with the decimation, if there is one, for the next
+ * RETENTION_LEAVES_AT_ONCE leaves. Once both branches have been taken
+ * they're erased.
+ */
+void decimate_some(void) {
+  uint8_t i;
+
+  if (decimate_leaf == 0xFFFFFFFF) { return; }
+
+  if (!take_leaves(decimating[decimate_index])) { return; }
+
+  if (decimate_index == 0) { /* On to the second branch */
+    decimate_index = 1;
+    decimate_leaf = decimating[1];
+    return;
+  }
+
+  take_last();
+
+  for (i = 0; i < 2; i++) {
+    erase_branch(decimating[i]);
+  }
+  /* The queue stops while we're in deep sleep, so see the erases through now */
+  for (i = 0; i < 2; i++) {
+    WaitForFlashChip(decimating[i]);
+  }
+
+  decimate_leaf = 0xFFFFFFFF;
+  retention_decimations++;
+}
+/**
+ * Finishes the decimation in one go. The writer has to wait for this
+ * if it comes to the fresh branch, which is rare as it's only just
+ * moved onto a branch of its own when one is started.
+ */
+void finish_decimation(void) {
+  while (decimate_leaf != 0xFFFFFFFF) {
+    decimate_some();
+  }
+}
+/**
+ * Returns 1 if decimated records are being written to the leaf's
+ * branch.
+ */
+uint8_t decimating_into(uint32_t leaf_addr) {
+  return decimate_leaf != 0xFFFFFFFF && (leaf_addr & 0xFFFFF000) == merged_branch;
+}
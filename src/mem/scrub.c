@@ -0,0 +1,90 @@
+/* 
+ * Checks the records in memory for corruption a few at a time
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "mem/btree.h"
+#include "mem/checksum.h"
+#include "mem/invalidate.h"
+#include "mem/record.h"
+#include "mem/scrub.h"
+
+/**
+ * Where the scrubber got up to. It carries on from here next time.
+ */
+uint32_t scrub_marker = 0xFFFFFFFF;
+uint32_t scrub_record[FULL_RECORD_SIZE/4];
+
+/**
+ * Checks the next few valid records in memory against their
+ * checksums, and invalidates any that fail so they're never
+ * uploaded. Once it gets to the end of the memory it starts again
+ * from the beginning next time.
+ *
+ * The leaves are read together, and then their records are streamed
+ * in one read, so this only looks along one branch at a time.
+ */
+void scrub(void) {
+  struct flash_stream stream;
+  uint8_t leaves[SCRUB_RECORDS_AT_ONCE];
+  uint32_t first, count;
+  uint16_t corrupt = 0;
+  uint8_t i;
+
+  if (scrub_marker == 0xFFFFFFFF) { scrub_marker = first_root(); }
+
+  if (next_record(&scrub_marker, MEM_VALID, NO_WRAP) == 0xFFFFFFFF) {
+    /* That's all of them, start again next time */
+    scrub_marker = 0xFFFFFFFF;
+    scrub_passes++;
+    return;
+  }
+
+  /* Up to the end of the branch */
+  first = scrub_marker;
+  count = MAX_RECORDS_PER_BRANCH - (first & 0x00000FFF);
+  if (count > SCRUB_RECORDS_AT_ONCE) { count = SCRUB_RECORDS_AT_ONCE; }
+  ReadFlash(first, leaves, count);
+
+  OpenFlashStream(&stream, leaf_addr_to_record_addr(first));
+  for (i = 0; i < count && leaves[i] != LEAF_ERASED; i++) {
+    if (leaves[i] == LEAF_INVALID || leaves[i] == LEAF_RESERVED) { continue; }
+
+    stream_full_record(&stream, first + i, scrub_record);
+    scrub_records_checked++;
+
+    if (evaluate_checksum((uint8_t*)scrub_record) == CHECKSUM_FAIL) {
+      corrupt |= 1 << i;
+    }
+  }
+  CloseFlashStream(&stream);
+
+  scrub_marker = first + i - 1; /* Carry on after the last one we looked at */
+
+  /* Invalidating uses the flash, so it waits until the stream's closed */
+  for (i = 0; corrupt; i++, corrupt >>= 1) {
+    if (corrupt & 1) {
+      invalidate(first + i);
+      scrub_records_corrupt++;
+    }
+  }
+}
@@ -0,0 +1,136 @@
+/* 
+ * Finds the records from a range of times
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "LPC11xx.h"
+#include "mem/btree.h"
+#include "mem/record.h"
+#include "mem/time_index.h"
+
+/**
+ * Leaves on a branch are written in order and each record is from a
+ * little before it was written, so the times on a branch only ever go
+ * backwards by up to TIME_INDEX_SLACK. That's enough to bisect a branch
+ * for the first record in a range, and to rule a branch out from just
+ * its first and last records. No index needs to be kept.
+ */
+
+/**
+ * Returns the first leaf on the branch that could have a record from
+ * from or later, or 0xFFFFFFFF if the branch can't have any records
+ * in the range.
+ */
+static uint32_t first_leaf_in_range(uint32_t branch, uint64_t from, uint64_t to) {
+  uint32_t tail = find_branch_tail(branch);
+  uint16_t low = 0, high = tail - branch, mid;
+
+  if (high == 0) { return 0xFFFFFFFF; } /* Nothing on it */
+
+  /* Everything after the first record is from no earlier than this */
+  if (read_record_time(branch) > to + TIME_INDEX_SLACK) { return 0xFFFFFFFF; }
+  /* And everything before the last is from no later than this */
+  if (read_record_time(tail - 1) + TIME_INDEX_SLACK < from) { return 0xFFFFFFFF; }
+
+  /* A record from before from - TIME_INDEX_SLACK means everything
+   * before it is out of the range */
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (read_record_time(branch + mid) + TIME_INDEX_SLACK < from) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return branch + low;
+}
+/**
+ * Returns the first leaf on the next branch after the given address
+ * that could have records in the range, or 0xFFFFFFFF if there are no
+ * more.
+ */
+static uint32_t next_branch_in_range(uint32_t address, uint64_t from, uint64_t to) {
+  uint32_t root = address & 0xFFF00000, branch = address, leaf;
+  uint16_t root_value = get_root(root);
+
+  while (1) {
+    branch = next_active_branch(root_value, branch);
+
+    if (branch == 0xFFFFFFFF) { /* Off the end of this tree */
+      root = next_root(root, NO_WRAP);
+      if (root == 0xFFFFFFFF) { return 0xFFFFFFFF; }
+      root_value = get_root(root);
+      branch = root;
+      continue;
+    }
+
+    leaf = first_leaf_in_range(branch, from, to);
+    if (leaf != 0xFFFFFFFF) { return leaf; }
+  }
+}
+/**
+ * Like next_record, returns the address of the next record after the
+ * marker that's from between from and to inclusive, and moves the
+ * marker to its leaf. Records that have already been invalidated are
+ * included, as long as their branch hasn't been erased yet. Returns
+ * 0xFFFFFFFF once there are no more.
+ *
+ * Start with the marker at first_root().
+ */
+uint32_t next_record_in_range(uint32_t* leaf_marker_addr, uint64_t from, uint64_t to) {
+  uint32_t leaf = *leaf_marker_addr + 1;
+  uint64_t time;
+  uint8_t status;
+
+  /* Not on a branch, or off the end of one */
+  if ((leaf & 0x0000F000) == 0 || (leaf & 0x00000FFF) >= MAX_RECORDS_PER_BRANCH) {
+    leaf = next_branch_in_range(*leaf_marker_addr, from, to);
+  }
+
+  while (leaf != 0xFFFFFFFF) {
+    status = get_leaf_status(leaf);
+
+    if (status == MEM_ERASED) { /* That's the end of this branch */
+      leaf = next_branch_in_range(leaf, from, to);
+      continue;
+    }
+    if (status == MEM_VALID || status == MEM_INVALID) {
+      time = read_record_time(leaf);
+
+      if (time >= from && time <= to) {
+	*leaf_marker_addr = leaf;
+	return leaf_addr_to_record_addr(leaf);
+      }
+      if (time > to + TIME_INDEX_SLACK) { /* The rest are too late */
+	leaf = next_branch_in_range(leaf, from, to);
+	continue;
+      }
+    }
+
+    if ((++leaf & 0x00000FFF) >= MAX_RECORDS_PER_BRANCH) {
+      leaf = next_branch_in_range(leaf - 1, from, to);
+    }
+  }
+
+  return 0xFFFFFFFF;
+}
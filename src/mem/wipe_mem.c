@@ -1,5 +1,5 @@
 /* 
- * Wipes the whole memory, no questions asked. Used when debugging.
+ * Wipes the whole memory when the gateway asks for it
  * Copyright (C) 2013  Richard Meadows
  * 
  * Permission is hereby granted, free of charge, to any person obtaining
@@ -23,18 +23,75 @@
  */
 
 #include "LPC11xx.h"
+#include <stdlib.h>
+#include "mem/btree.h"
 #include "mem/flash.h"
+#include "mem/record.h"
+#include "mem/wipe_mem.h"
 
+enum {
+  WIPE_SECTOR_SIZE	= 0x1000,
+  WIPE_BLOCK_SIZE	= 0x10000,
+  /**
+   * If more sectors than this are dirty, one 64 KByte erase is
+   * quicker than erasing them separately.
+   */
+  WIPE_MAX_SECTOR_ERASES = 4,
+};
+
+/**
+ * Blank checks each sector of a 64 KByte block and queues erases for
+ * the ones that need it. The first block of each tree holds the root
+ * and branch sectors, which keep their erase counts, so they're always
+ * erased a sector at a time and don't count the end of the sector.
+ */
+static void wipe_block(uint32_t block) {
+  uint32_t sector, size = WIPE_SECTOR_SIZE;
+  uint16_t dirty = 0;
+  uint8_t i, dirty_count = 0, counted = ((block & 0x000FFFFF) == 0);
+
+  if (counted) { size = ERASE_COUNT_OFFSET; }
+
+  for (i = 0, sector = block; i < WIPE_BLOCK_SIZE / WIPE_SECTOR_SIZE;
+       i++, sector += WIPE_SECTOR_SIZE) {
+    if (ReadFlashAND(sector, size) != 0xFF) {
+      dirty |= 1 << i;
+      dirty_count++;
+    }
+  }
+  if (dirty_count == 0) { return; } /* Already blank */
+
+  forget_branch_header(block); /* Our copy of the header is about to go stale */
+
+  if (counted) {
+    for (i = 0, sector = block; dirty; i++, sector += WIPE_SECTOR_SIZE, dirty >>= 1) {
+      if (dirty & 1) { erase_counted_sector(sector); }
+    }
+  } else if (dirty_count > WIPE_MAX_SECTOR_ERASES) {
+    StartPageErase(block, NULL);
+  } else {
+    for (i = 0, sector = block; dirty; i++, sector += WIPE_SECTOR_SIZE, dirty >>= 1) {
+      if (dirty & 1) { StartSectorErase(sector, NULL); }
+    }
+  }
+}
+/**
+ * Erases everything that isn't already blank. The erases are queued,
+ * so one chip is blank checked while another is erasing.
+ */
 void wipe_mem(void) {
-  uint32_t address;
+  uint32_t address, block;
 
   /* Get the address of the first chip in memory */
   address = NextPage(0xFFFFFFFF);
 
-  do {
-    ChipErase(address); /* Erase the chip */
-    WaitForBusyClear(address); /* Wait for the erase to complete */
+  while (address != 0xFFFFFFFF) { /* While there is a next chip */
+    for (block = 0; block < flash_sizes[address >> 24]; block += WIPE_BLOCK_SIZE) {
+      wipe_block(address | block);
+    }
 
     address = NextChip(address, NO_WRAP); /* Move on to the next chip */
-  } while (address != 0xFFFFFFFF); /* While there is a next chip */
+  }
+
+  WaitForFlashQueue(); /* Wait for the erases to complete */
 }
@@ -22,36 +22,140 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include "mem/btree.h"
 #include "mem/flash.h"
 #include "mem/checksum.h"
+#include "mem/record.h"
+#include "mem/retention.h"
+#include "mem/write.h"
 #include "timing.h"
 #include "debug.h"
 
 /**
- * Each sample taken is stored in a record that is structured as follows:
- *
- * WORD NR	USE
- * 0:		RECORD_FLAGS
- * 1: 		UNIX_TIME LSB
- * 2: 		UNIX_TIME MSB
- * 3: 		LEFT CHANNEL READING
- * 4:		RIGHT CHANNEL READING
- * 5:		CHECKSUM
+ * Each sample taken is stored in a record. See record.c for how the
+ * records are laid out.
  *
  * There are an integer number of records stored in each 64
- * KByte. This value is called RECORDS_PER_PAGE.
+ * KByte. This value is called MAX_RECORDS_PER_BRANCH.
  *
  */
 
+enum {
+  /**
+   * The number of branches we'll try before giving up on a record
+   * that doesn't fit on any of them.
+   */
+  MAX_BRANCH_ATTEMPTS = 16,
+};
+
+/**
+ * The full record, which is what gets checksummed.
+ */
+uint32_t full_block[FULL_RECORD_SIZE/4];
 /**
  * We use a 32-bit buffer so we can write 32-bit values straight to it.
  */
 uint32_t write_block[RECORD_SIZE/4];
+/**
+ * Records waiting to be written out. These are for consecutive leaves
+ * starting at queue_leaf_address, so their records are consecutive too.
+ */
+uint32_t write_queue[WRITE_QUEUE_LENGTH*RECORD_SIZE/4];
+uint32_t queue_leaf_address;
+uint8_t queue_count;
+/**
+ * The leaf markers for the queue, with room to pad them out to whole
+ * words for the automatic write.
+ */
+uint8_t queue_leaves[WRITE_QUEUE_LENGTH+2];
+/**
+ * The same leaves again, committed once the records are written.
+ */
+uint8_t queue_commits[WRITE_QUEUE_LENGTH+2];
+/**
+ * Set from when the queue is flushed until its records are in memory.
+ */
+uint8_t flush_pending;
+/**
+ * The records from the last flush, so they can be read back
+ */
+uint32_t flushed_leaf;
+uint32_t* flushed_records;
+uint8_t flushed_count;
+/**
+ * Records from the last flush that are being written again, and how
+ * many times that's happened.
+ */
+uint32_t retry_records[WRITE_QUEUE_LENGTH*RECORD_SIZE/4];
+uint8_t retry_attempts;
 /**
  * We store the write_leaf_address for quickly finding empty blocks next time.
  */
 uint32_t write_leaf_address;
+/**
+ * Set once write_leaf_address is a leaf we've found erased. Leaves on
+ * a branch are only ever written in order, so the rest of its branch
+ * is erased too.
+ */
+uint8_t write_leaf_found;
+/**
+ * Set when reclaim_ahead should see if the memory's getting full.
+ */
+uint8_t space_check_due;
+
+/**
+ * Moves write_leaf_address on to the next erased leaf and returns the
+ * address of its record. While the chip's busy the next leaf on the
+ * same branch is taken without reading it, so the record can be
+ * queued up behind an erase rather than waiting for it.
+ */
+static uint32_t next_writable_leaf(void) {
+  uint32_t record_address, last_leaf = write_leaf_address;
+
+  if (write_leaf_found && FlashChipBusy(write_leaf_address) &&
+      (write_leaf_address & 0x00000FFF) < MAX_RECORDS_PER_BRANCH - 1) {
+    write_leaf_address++;
+    return leaf_addr_to_record_addr(write_leaf_address);
+  }
+
+  record_address = next_record(&write_leaf_address, MEM_ERASED, WRAP);
+
+  /* The leaves for the queue are still erased in memory. If the search
+   * has come all the way round to them, write them out and look again */
+  if (record_address != 0xFFFFFFFF && queue_count > 0 &&
+      write_leaf_address - queue_leaf_address < queue_count) {
+    flush_writes();
+    wait_for_write_complete();
+    record_address = next_record(&write_leaf_address, MEM_ERASED, WRAP);
+  }
+
+  /* Decimated records are going onto this branch, so that has to
+   * finish first */
+  if (record_address != 0xFFFFFFFF && decimating_into(write_leaf_address)) {
+    write_leaf_address = last_leaf;
+    finish_decimation();
+    record_address = next_record(&write_leaf_address, MEM_ERASED, WRAP);
+  }
+  write_leaf_found = (record_address != 0xFFFFFFFF);
+
+  /* Moving onto another branch, or out of them, is the time to check
+   * there's still enough space left */
+  if (record_address == 0xFFFFFFFF ||
+      (write_leaf_address & 0xFFFFF000) != (last_leaf & 0xFFFFF000)) {
+    space_check_due = 1;
+  }
+
+  /* The memory's full. A failed search leaves the marker at the start
+   * of whichever branch it looked at last, where a write would skip
+   * activating the branch if it's erased by then. Look from where we
+   * were next time */
+  if (!write_leaf_found) {
+    write_leaf_address = last_leaf;
+  }
+
+  return record_address;
+}
 
 /**
  * Writes a sample to memory with the specified record_flags.
@@ -60,49 +164,268 @@ uint32_t write_leaf_address;
  */
 void write_sample_to_mem(uint32_t record_flags, uint32_t left_data, uint32_t right_data, uint32_t time_ago) {
   uint32_t record_address;
+  uint8_t attempts = 0;
 
-  /* Get the address of the next writable leaf */
-  record_address = next_record(&write_leaf_address, MEM_ERASED, WRAP);
+  /* Populate the full_block */
+  full_block[0] = record_flags; /* Record flags */
+
+  struct time_64_t time = get_time(); /* Unix time */
+  if (time_ago > time.low) { time.high--; }
+  time.low -= time_ago; /* Subtract time_ago */
+  full_block[1] = time.low;
+  full_block[2] = time.high;
+
+  full_block[3] = left_data; /* Data */
+  full_block[4] = right_data;
+
+  full_block[5] = calculate_checksum((uint8_t*)full_block); /* Checksum */
+
+  /* The last flush might still be writing out of the queue, and
+   * anything it writes again goes on the leaves after it */
+  if (queue_count == 0) {
+    wait_for_write_complete();
+  }
+
+  do {
+    /* If this record doesn't fit on the last branch we tried */
+    if (attempts > 0) {
+      write_leaves_skipped += MAX_RECORDS_PER_BRANCH - (write_leaf_address & 0x00000FFF);
+      skip_rest_of_branch(&write_leaf_address);
+    }
+
+    /* Get the address of the next writable leaf */
+    record_address = next_writable_leaf();
+
+    /* If there's no more writable blocks, return */
+    if (record_address == 0xFFFFFFFF) {
+      return;
+    }
+
+    /* If we've run out of branches to try, give up on this record */
+    if (attempts++ >= MAX_BRANCH_ATTEMPTS) {
+      return;
+    }
+
+    /* Put the record into the layout we store */
+  } while (pack_record(record_address, full_block, write_block) == 0);
 
-  /* If there's no more writable blocks, return */
-  if (record_address == 0xFFFFFFFF) {
+  /* If this record doesn't follow on from the queue, write the queue out first */
+  if (queue_count > 0 && write_leaf_address != queue_leaf_address + queue_count) {
+    flush_writes();
+    wait_for_write_complete();
+  }
+
+  /* Add the record to the queue */
+  if (queue_count == 0) {
+    queue_leaf_address = write_leaf_address;
+  }
+  memcpy(write_queue + queue_count*(RECORD_SIZE/4), write_block, RECORD_SIZE);
+
+  if (++queue_count >= WRITE_QUEUE_LENGTH) {
+    flush_writes();
+  }
+}
+/**
+ * Called once the records from a flush are in memory.
+ */
+static void flush_complete(uint32_t address) {
+  (void)address;
+
+  flush_pending = 0;
+}
+/**
+ * Writes out any records waiting in the queue. The leaves are all
+ * reserved in one automatic write, the records follow in another, and
+ * then a third commits the leaves. If we lose power part way through,
+ * the leaves are left reserved and the records are never uploaded.
+ */
+void flush_writes(void) {
+  if (queue_count == 0) {
     return;
   }
 
-  /* Populate the write_block */
-  write_block[0] = record_flags; /* Record flags */
+  write_records(queue_leaf_address, write_queue, queue_count);
 
-  struct time_64_t time = get_time(); /* Unix time */
-  if (time_ago > time.low) { time.high--; }
-  time.low -= time_ago; /* Subtract time_ago */
-  write_block[1] = time.low;
-  write_block[2] = time.high;
+  queue_count = 0;
+}
+/**
+ * Writes up to WRITE_QUEUE_LENGTH packed records out to the leaves
+ * from leaf_addr onwards. The leaves are reserved first and only
+ * marked valid once the records are written, so recover_torn_writes
+ * can tidy up after a power cut part way through. The records must
+ * stay put until wait_for_write_complete returns.
+ */
+void write_records(uint32_t leaf_addr, uint32_t* records, uint8_t count) {
+  uint8_t i, len = 0;
 
-  write_block[3] = left_data; /* Data */
-  write_block[4] = right_data;
+  /**
+   * The automatic write works in whole words. Writing 0xFF leaves a
+   * byte as it was, so we pad with that.
+   */
+  if (leaf_addr & 1) { queue_commits[len] = queue_leaves[len] = 0xFF; len++; }
+  for (i = 0; i < count; i++, len++) {
+    queue_leaves[len] = LEAF_RESERVED;
+    queue_commits[len] = LEAF_VALID;
+  }
+  if (len & 1) { queue_commits[len] = queue_leaves[len] = 0xFF; len++; }
+
+  /* Once the memory has wrapped round these can be behind the uploads */
+  if (leaf_addr <= oldest_leaf_marker) { oldest_leaf_marker = leaf_addr - 1; }
 
-  write_block[5] = calculate_checksum((uint8_t*)write_block); /* Checksum */
+  if (records != retry_records) { retry_attempts = 0; }
+  flushed_leaf = leaf_addr;
+  flushed_records = records;
+  flushed_count = count;
+  flush_end_leaf = leaf_addr + count;
 
-  WriteFlashByte(write_leaf_address, 0x52); /* Mark the leaf as valid */
-  StartWriteFlash(record_address, (uint8_t*)write_block, RECORD_SIZE); /* Write the record */
+  flush_pending = 1;
+  StartWriteFlash(leaf_addr & ~1, queue_leaves, len, NULL); /* Reserve the leaves */
+  StartWriteFlash(leaf_addr_to_record_addr(leaf_addr), (uint8_t*)records,
+		  count*RECORD_SIZE, NULL); /* Write the records */
+  StartWriteFlash(leaf_addr & ~1, queue_commits, len, flush_complete); /* Commit */
 }
+#ifdef VERIFY_WRITES
 /**
- * Blocks until any pending flash write completes.
+ * Reads back the records from the last flush. The leaves of any that
+ * didn't go in properly are retired, and the records are written
+ * again on the leaves after the flush. They're packed for the
+ * branch's header, so they have to fit on the same branch. Returns 1
+ * if there's another flush to wait for.
  */
-void wait_for_write_complete(void) {
-  uint32_t i = 0;
+static uint8_t verify_flush(void) {
+  uint32_t leaf = flushed_leaf, *record = flushed_records;
+  uint8_t i, count = 0;
+
+  if (flushed_count == 0) {
+    return 0;
+  }
+
+  /* When it's all good, which it nearly always is, one read will do */
+  if (CompareFlash(leaf_addr_to_record_addr(leaf), (uint8_t*)record,
+		   flushed_count*RECORD_SIZE) == 0) {
+    for (i = 0; i < flushed_count; i++, leaf++, record += RECORD_SIZE/4) {
+      if (CompareFlash(leaf_addr_to_record_addr(leaf), (uint8_t*)record, RECORD_SIZE) == 0) {
+	WriteFlashByte(leaf, LEAF_INVALID); /* Retire it */
+	verify_failures++;
+
+	memmove(retry_records + count*(RECORD_SIZE/4), record, RECORD_SIZE);
+	count++;
+      }
+    }
+  }
+  flushed_count = 0;
 
-  while (writeflash_active) {
-    if (i++ > 100000) { /* Timeout */
-      debug_printf("Timeout waiting for write to complete!\n");
-      break;
+  if (count == 0) {
+    return 0;
+  }
+
+  leaf = flush_end_leaf;
+  if (retry_attempts++ >= VERIFY_ATTEMPTS ||
+      (leaf & 0x00000FFF) + count > MAX_RECORDS_PER_BRANCH ||
+      ReadFlashAND(leaf, count) != LEAF_ERASED) {
+    verify_dropped += count;
+    return 0;
+  }
+
+  write_records(leaf, retry_records, count);
+  return 1;
+}
+#endif
+/**
+ * Blocks until the records from the last flush are in memory. Erases
+ * queued on other chips carry on in the background.
+ */
+void wait_for_write_complete(void) {
+#ifdef VERIFY_WRITES
+  do {
+    while (flush_pending) {
+      StepFlashQueue();
     }
+  } while (verify_flush());
+
+  /* The writer carries on after anything that was written again */
+  if ((write_leaf_address & 0xFFFFF000) == (flush_end_leaf & 0xFFFFF000) &&
+      write_leaf_address < flush_end_leaf - 1) {
+    write_leaf_address = flush_end_leaf - 1;
   }
+#else
+  while (flush_pending) {
+    StepFlashQueue();
+  }
+#endif
+}
+/**
+ * A reset part way through a flush leaves reserved leaves behind. Only
+ * one flush is ever in progress and it's at the end of what's been
+ * written on its branch, so we just look at the last few leaves on
+ * each active branch. Records that made it to memory intact are
+ * committed, and the rest are invalidated.
+ */
+static void recover_torn_writes(void) {
+  uint32_t tree = first_root(), branch, tail, leaf;
+  uint16_t root;
+
+  do {
+    root = get_root(tree);
+
+    for (branch = next_active_branch(root, tree); branch != 0xFFFFFFFF;
+	 branch = next_active_branch(root, branch)) {
+      tail = find_branch_tail(branch);
+
+      for (leaf = tail; leaf > branch && leaf + WRITE_QUEUE_LENGTH > tail; ) {
+	if (ReadFlashByte(--leaf) == LEAF_RESERVED) {
+	  read_full_record(leaf, full_block);
+
+	  if (evaluate_checksum((uint8_t*)full_block) == CHECKSUM_PASS) {
+	    WriteFlashByte(leaf, LEAF_VALID);
+	  } else {
+	    WriteFlashByte(leaf, LEAF_INVALID);
+	  }
+	}
+      }
+    }
+
+    tree = next_root(tree, NO_WRAP);
+  } while (tree != 0xFFFFFFFF);
 }
 /**
  * Init.
  */
 void init_write(void) {
+  /* Tidy up after a flush we didn't finish */
+  recover_torn_writes();
+
   /* Start at the beginning of the memory */
   write_leaf_address = first_root();
+  write_leaf_found = 0;
+  /* Uploads have to look through all of it once */
+  oldest_leaf_marker = first_root();
+  /* With nothing waiting */
+  queue_count = 0;
+  flush_pending = 0;
+  flushed_count = 0;
+  /* Look for anything we can reclaim */
+  init_reclaim();
+  /* And see how much space there is */
+  space_check_due = 1;
+}
+/**
+ * Erases a branch that's had all its leaves invalidated, ahead of
+ * where we're writing. Call this on wakes with nothing else to do, so
+ * writes don't have to find and erase branches themselves.
+ */
+void reclaim_ahead(void) {
+  uint32_t branch = reclaim_branch(write_leaf_address);
+
+  /* The queue stops while we're in deep sleep, so see the erase through now */
+  if (branch != 0xFFFFFFFF) {
+    WaitForFlashChip(branch);
+  }
+
+  /* If we're running out of space, make some from the oldest records */
+  if (space_check_due) {
+    space_check_due = 0;
+    retain_space(write_leaf_address);
+  }
+  decimate_some();
 }
@@ -596,6 +596,7 @@ void at86rf212_tx(uint8_t* data, uint8_t length, uint16_t destination,
   radif->exit_protected();
 
   /* Actually start the transmission */
+  radif->tx_in_progress = 1;
   at86rf212_reg_read_mod_write(TRX_STATE, CMD_TX_START, 0x1F, radif);
 }
 /**
@@ -629,14 +630,18 @@ void at86rf212_tx_end(struct radif* radif) {
 
     /* Wait for something to be received */
     while ((at86rf212_reg_read(IRQ_STATUS, radif) & RADIO_IRQ_TRX_END) == 0) {
-      if (i++ > QUERY_TIMEOUT*10) { return; }
+      if (i++ > QUERY_TIMEOUT*10) { break; }
       radif->delay_us(100);
     }
 
     /* When it is, call the handler */
-    at86rf212_rx(radif);
+    if (i <= QUERY_TIMEOUT*10) {
+      at86rf212_rx(radif);
+    }
   }
 #endif
+
+  radif->tx_in_progress = 0;
 }
 
 /* -------- Interrupt -------- */
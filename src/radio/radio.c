@@ -26,6 +26,7 @@
 #include "string.h"
 #include "at86rf212.h"
 #include "spi.h"
+#include "mem/flash.h"
 
 /**
  * Declare a global struct to hold the current state of the radio.
@@ -49,13 +50,30 @@ struct radif rf212_radif;
 #define RF212_SLPTR_PIN		1
 
 /**
- * Slave Select: Active Low
+ * How many milliseconds a transmission can take, including the wait
+ * for a reply, before we give up on it
  */
+#define TX_END_TIMEOUT		100
+
+/**
+ * Slave Select: Active Low. The flash shares the bus and can hold it
+ * during an automatic write, so we wait for it and keep the interrupts
+ * off while the radio's selected.
+ */
+uint32_t rf212_spi_primask;
+uint8_t rf212_spi_claimed = 0;
+
 void rf212_spi_enable(void) {
+  rf212_spi_primask = ClaimSharedBus();
+  rf212_spi_claimed = 1;
   RF212_SSEL_PORT->MASKED_ACCESS[(1 << RF212_SSEL_PIN)] = 0;
 }
 void rf212_spi_disable(void) {
   RF212_SSEL_PORT->MASKED_ACCESS[(1 << RF212_SSEL_PIN)] = (1 << RF212_SSEL_PIN);
+  if (rf212_spi_claimed) { /* The reset deselects without selecting first */
+    rf212_spi_claimed = 0;
+    __set_PRIMASK(rf212_spi_primask);
+  }
 }
 /**
  * Reset: Active Low
@@ -228,3 +246,18 @@ void radio_wake(void) {
 uint16_t radio_get_trac_status(void) {
   return rf212_radif.last_trac_status;
 }
+/**
+ * Waits for the last transmission to finish, and for any reply to it
+ * to be dealt with. Returns its TRAC status, or TRAC_INVALID if it
+ * never finished.
+ */
+uint16_t radio_wait_for_tx_end(void) {
+  uint32_t i = 0;
+
+  while (rf212_radif.tx_in_progress) {
+    if (i++ > TX_END_TIMEOUT*10) { return TRAC_INVALID; }
+    radio_delay_us(100);
+  }
+
+  return rf212_radif.last_trac_status;
+}
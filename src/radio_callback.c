@@ -23,10 +23,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "radio/radio.h"
 #include "console.h"
 #include "mem/invalidate.h"
+#include "mem/wipe_mem.h"
+#include "upload.h"
+#include "dump.h"
 #include "timing.h"
 
 /**
@@ -68,6 +72,90 @@ static void radio_checksum_frame(uint8_t* data) {
   /* If this address and checksum match the block at address will be erased */
   check_and_invalidate(address, checksum);
 }
+/**
+ * An ack for several records at once, from a leaf address and a bitmap
+ * of which of the leaves from there it covers. The checksum is the sum
+ * of all their checksums. After that there's the base station's report
+ * of which upload frames it has.
+ */
+static void radio_bitmap_checksum_frame(uint8_t* data, uint8_t length) {
+  uint32_t address; uint32_t checksum;
+
+  if (length < 10) { return; }
+
+  address = data[1];
+  address |= data[2] << 8;
+  address |= data[3] << 16;
+  address |= data[4] << 24;
+
+  checksum = data[6];
+  checksum |= data[7] << 8;
+  checksum |= data[8] << 16;
+  checksum |= data[9] << 24;
+
+  console_printf("Got Ack: 0x%08x bitmap 0x%02x\n", address, data[5]);
+
+  /* The leaves whose records match are added to the next invalidation */
+  check_and_invalidate_bitmap(address, data[5], checksum);
+
+  if (length >= 13) {
+    upload_report(data[10], data[11] | (data[12] << 8));
+  }
+}
+/**
+ * The gateway wants the memory wiped. It has to spell it out, so a
+ * corrupted frame can't do it.
+ */
+static void radio_wipe_frame(uint8_t* data, uint8_t length) {
+  if (length >= 4 && memcmp(data, "WIPE", 4) == 0) {
+    console_printf("Wipe requested\n");
+
+    /* It takes a while, so it's done at the end of the wake */
+    wipe_requested = 1;
+  }
+}
+/**
+ * The base station has lost some records and wants everything from
+ * between two times uploaded again.
+ */
+static void radio_reupload_frame(uint8_t* data, uint8_t length) {
+  uint64_t from = 0, to = 0;
+  uint8_t i;
+
+  if (length < 17) { return; }
+
+  for (i = 8; i > 0; i--) {
+    from = (from << 8) | data[i];
+    to = (to << 8) | data[i+8];
+  }
+
+  console_printf("Re-upload requested\n");
+
+  request_reupload(from, to);
+}
+/**
+ * The gateway wants the raw memory from between two addresses, or
+ * some of a dump again that it missed.
+ */
+static void radio_dump_frame(uint8_t* data, uint8_t length) {
+  uint32_t from, to;
+
+  if (length < 9) { return; }
+
+  from = data[1];
+  from |= data[2] << 8;
+  from |= data[3] << 16;
+  from |= data[4] << 24;
+
+  to = data[5];
+  to |= data[6] << 8;
+  to |= data[7] << 16;
+  to |= data[8] << 24;
+
+  console_printf("Dump requested: 0x%08x to 0x%08x\n", from, to);
+
+  request_dump(from, to);
+}
 /**
  * Called when any data is received.
  */
@@ -83,6 +171,18 @@ void radio_rx_callback(uint8_t* data, uint8_t length,
     case 'A': /* Checksum */
       radio_checksum_frame(data);
       return;
+    case 'K': /* Checksum for a bitmap of records */
+      radio_bitmap_checksum_frame(data, length);
+      return;
+    case 'R': /* Re-upload a range of times */
+      radio_reupload_frame(data, length);
+      return;
+    case 'B': /* Bulk dump of the memory */
+      radio_dump_frame(data, length);
+      return;
+    case 'W': /* Wipe */
+      radio_wipe_frame(data, length);
+      return;
     case 'D': /* This is just a response to a debug packet, ignore */
       return;
     default:
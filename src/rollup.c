@@ -0,0 +1,103 @@
+/* 
+ * Rolls readings up into records over longer periods
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "LPC11xx.h"
+#include "mem/write.h"
+#include "rollup.h"
+#include "settings.h"
+
+/**
+ * Running totals for a tier. Nothing's kept but these, so it costs
+ * the same however long the tier is.
+ */
+struct rollup_tier {
+  uint64_t left_sum, right_sum;
+  uint32_t left_min, left_max;
+  uint32_t right_min, right_max;
+  uint32_t count;
+};
+
+struct rollup_tier rollup_tiers[MAX_ROLLUP_TIERS];
+
+/**
+ * Writes out the records for a tier that's complete. Their time is
+ * the end of the tier, so they go in order with everything else and
+ * the base station knows where they start from the length in their
+ * flags.
+ */
+static void write_rollup(uint8_t tier, struct rollup_tier* t) {
+  uint32_t time_ago = 0;
+
+  write_sample_to_mem(get_rollup_record_flags(tier, ROLLUP_MEAN),
+		      (uint32_t)(t->left_sum / t->count),
+		      (uint32_t)(t->right_sum / t->count), time_ago);
+  write_sample_to_mem(get_rollup_record_flags(tier, ROLLUP_LEFT_RANGE),
+		      t->left_min, t->left_max, time_ago);
+  write_sample_to_mem(get_rollup_record_flags(tier, ROLLUP_RIGHT_RANGE),
+		      t->right_min, t->right_max, time_ago);
+}
+/**
+ * Adds a 500 ms reading to each tier, and writes out any that are
+ * complete.
+ */
+void rollup_reading(uint32_t left, uint32_t right) {
+  struct rollup_tier* t;
+  uint32_t readings;
+  uint8_t tier;
+
+  for (tier = 0; tier < MAX_ROLLUP_TIERS; tier++) {
+    readings = get_rollup_tier_seconds(tier) * READINGS_PER_SECOND;
+    if (readings == 0) { continue; } /* Unused */
+
+    t = &rollup_tiers[tier];
+
+    if (t->count == 0) { /* Start this tier again */
+      t->left_sum = t->right_sum = 0;
+      t->left_min = t->left_max = left;
+      t->right_min = t->right_max = right;
+    }
+
+    t->left_sum += left;
+    t->right_sum += right;
+    if (left < t->left_min) { t->left_min = left; }
+    if (left > t->left_max) { t->left_max = left; }
+    if (right < t->right_min) { t->right_min = right; }
+    if (right > t->right_max) { t->right_max = right; }
+
+    if (++t->count >= readings) {
+      write_rollup(tier, t);
+      t->count = 0;
+    }
+  }
+}
+/**
+ * Throws away any partly complete tiers.
+ */
+void rollup_reset(void) {
+  uint8_t tier;
+
+  for (tier = 0; tier < MAX_ROLLUP_TIERS; tier++) {
+    rollup_tiers[tier].count = 0;
+  }
+}
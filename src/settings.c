@@ -24,6 +24,7 @@
 
 #include "LPC11xx.h"
 #include "audio/wm8737.h"
+#include "rollup.h"
 
 /**
  * ======== Tuning ========
@@ -34,6 +35,14 @@
 #define LEFT_TUNED_BIN		7	/* 21kHz - 24kHz */
 #define RIGHT_TUNED_BIN		7	/* 21kHz - 24KHz */
 
+/**
+ * ======== Roll-ups ========
+ */
+
+#define ROLLUP_TIER_0_SECONDS	600	/* 10 minutes */
+#define ROLLUP_TIER_1_SECONDS	3600	/*     1 hour */
+#define ROLLUP_TIER_2_SECONDS	0	/*     Unused */
+
 /**
  * ======== Gain ========
  */
@@ -44,6 +53,12 @@
 #define LEFT_MICBOOST		0	/* +33 dB */
 #define RIGHT_MICBOOST		0	/* +33 dB */
 
+/**
+ * ======== Uploads ========
+ */
+
+#define UPLOAD_WINDOW		8	/* Frames in flight, 1 to 16 */
+
 /**
  * ======== Tuning ========
  */
@@ -72,6 +87,28 @@ uint32_t get_envelope_record_flags(void) {
     RIGHT_MICBOOST << 8 |
     RIGHT_PGA_GAIN;
 }
+uint16_t get_rollup_tier_seconds(uint8_t tier) {
+  switch (tier) {
+    case 0: return ROLLUP_TIER_0_SECONDS;
+    case 1: return ROLLUP_TIER_1_SECONDS;
+    case 2: return ROLLUP_TIER_2_SECONDS;
+    default: return 0;
+  }
+}
+/**
+ * Roll-up records have ROLLUP_RECORD_TYPE where the left frequency
+ * would be, then the statistic they hold where the left micboost would
+ * be and the length of their tier in minutes where the left gain would
+ * be. The rest is the right channel's tuning as usual.
+ */
+uint32_t get_rollup_record_flags(uint8_t tier, uint8_t statistic) {
+  return (uint32_t)ROLLUP_RECORD_TYPE << 26 |
+    statistic << 24 |
+    ((get_rollup_tier_seconds(tier) / 60) & 0xFF) << 16 |
+    RIGHT_TARGET_FREQ << 10 |
+    RIGHT_MICBOOST << 8 |
+    RIGHT_PGA_GAIN;
+}
 uint8_t get_left_tuned_bin(void) {
   return LEFT_TUNED_BIN;
 }
@@ -106,3 +143,12 @@ uint8_t get_right_micboost(void) {
     default: return PATH_33DB_MICBOOST;
   }
 }
+
+/**
+ * ======== Uploads ========
+ */
+uint8_t get_upload_window(void) {
+  if (UPLOAD_WINDOW < 1) { return 1; }
+  if (UPLOAD_WINDOW > 16) { return 16; }
+  return UPLOAD_WINDOW;
+}
@@ -22,76 +22,452 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include "upload.h"
 #include "radio/radio.h"
 #include "mem/btree.h"
 #include "mem/flash.h"
-#include "console.h"
+#include "mem/invalidate.h"
+#include "mem/record.h"
+#include "mem/time_index.h"
+#include "mem/write.h"
+#include "rollup.h"
+#include "settings.h"
 
 enum {
   /**
-   * The number of bytes of upload header we put at the start of each frame
+   * The number of bytes of upload header we put at the start of each
+   * frame: the type, the sequence number and the first leaf address
    */
-  HEADER_SIZE =			5,
+  HEADER_SIZE =			6,
   /**
-   * The number of records that are uploaded before we give up if the
-   * other end hasn't responded.
+   * After the leaf address there's a bitmap of which of the leaves
+   * from there the frame has records for
    */
-  UPLOADS_WITHOUT_ACK =		1,
+  FRAME_HEADER_SIZE =		HEADER_SIZE + 1,
   /**
-   * The number of records we can upload in one go
+   * As many records as fit in a frame, after the MAC header and FCS
+   */
+  RECORDS_PER_FRAME =		(127 - 9 - 2 - FRAME_HEADER_SIZE) / FULL_RECORD_SIZE,
+  /**
+   * The leaves a frame's records can come from, one for each bit of
+   * the bitmap
+   */
+  FRAME_LEAF_SPAN =		8,
+  /**
+   * The base station's reports cover the frame they're for and the 16
+   * before it, so there can't be more frames than that in flight
+   */
+  UPLOAD_WINDOW_MAX =		16,
+  /**
+   * The number of records we can upload in one go, including any that
+   * are sent again
    */
   MAX_UPLOADS_AT_ONCE =		200,
+  /**
+   * The number of polls in a row the base station can miss before we
+   * treat it as an outage. Once it's back the roll-ups go first.
+   */
+  OUTAGE_UPLOADS =		4,
+  /**
+   * The number of leaves we look through for roll-ups in one go
+   */
+  COARSE_LEAVES_AT_ONCE =	4096,
+};
+
+/**
+ * What's become of a frame in the window
+ */
+enum {
+  SLOT_FREE =	0, /* Reported as received, or never used */
+  SLOT_SENT =	1, /* Waiting to hear about it */
+  SLOT_LOST =	2, /* The base station's reported it missing */
 };
 
-uint8_t upload_frame_buffer[HEADER_SIZE + RECORD_SIZE];
+/**
+ * A frame that's been sent and not yet reported as received. It's
+ * read from the memory again if it has to be sent again.
+ */
+struct upload_slot {
+  uint32_t leaf;
+  uint8_t bitmap;
+  uint8_t state;
+};
+
+uint8_t upload_frame_buffer[FRAME_HEADER_SIZE + RECORDS_PER_FRAME*FULL_RECORD_SIZE];
+uint32_t upload_record[FULL_RECORD_SIZE/4];
 uint32_t up_count = 0;
 
 /**
- * Uploads a record from memory.
+ * The frames in flight, by sequence number. There are 256 sequence
+ * numbers, so each one always lands in the same slot.
  */
-void do_upload(uint32_t record_addr, uint32_t leaf_addr, uint8_t ack) {
-  up_count++;
+struct upload_slot upload_window[UPLOAD_WINDOW_MAX];
+uint8_t upload_next_seq = 0;
 
-  /* Set the frame header */
-  upload_frame_buffer[0] = 'U';
+/**
+ * The last report from the base station: the newest frame it has, and
+ * a bitmap of which of the 16 before that it has too. These are set in
+ * the radio interrupt.
+ */
+volatile uint8_t report_seq;
+volatile uint16_t report_history;
+volatile uint8_t report_fresh = 0;
 
-  /* Set the leaf address */
-  upload_frame_buffer[1] = leaf_addr & 0xFF; leaf_addr >>= 8;
+/**
+ * The records in the frame we're putting together
+ */
+uint32_t frame_leaf;
+uint8_t frame_bitmap, frame_records = 0;
+
+/**
+ * A range of times the base station wants uploaded again
+ */
+uint64_t reupload_from, reupload_to;
+uint32_t reupload_marker;
+
+/**
+ * How we're catching up after an outage. A poll's answered if the base
+ * station acked it.
+ */
+uint8_t poll_answered = 0;
+uint8_t missed_uploads = 0;
+uint8_t coarse_active = 0;
+uint32_t coarse_marker;
+uint16_t coarse_leaves_scanned;
+
+/**
+ * How far we've got through the memory this time, and where we started
+ */
+uint32_t leaf_marker, leaf_marker_start;
+uint8_t oldest_leaf_checked;
+
+/**
+ * Returns the slot a sequence number uses.
+ */
+static struct upload_slot* slot_for(uint8_t seq) {
+  return &upload_window[seq % UPLOAD_WINDOW_MAX];
+}
+/**
+ * Looks for the oldest frame in flight that's in the given state.
+ * Returns 1 and sets seq if there is one.
+ */
+static uint8_t oldest_in_state(uint8_t state, uint8_t* seq) {
+  uint8_t i, s;
+
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    s = upload_next_seq - UPLOAD_WINDOW_MAX + i;
+    if (slot_for(s)->state == state) { *seq = s; return 1; }
+  }
+  return 0;
+}
+/**
+ * Returns 1 if there's room in the window for another new frame.
+ */
+static uint8_t window_has_room(void) {
+  uint8_t i, s;
+
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    s = upload_next_seq - UPLOAD_WINDOW_MAX + i;
+    if (slot_for(s)->state != SLOT_FREE) {
+      /* The oldest frame in flight */
+      return (uint8_t)(upload_next_seq - s) < get_upload_window();
+    }
+  }
+  return 1;
+}
+/**
+ * Returns 1 if the leaf is in one of the frames in flight.
+ */
+static uint8_t in_window(uint32_t leaf_addr) {
+  struct upload_slot* slot;
+  uint8_t i;
+
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    slot = &upload_window[i];
+    if (slot->state != SLOT_FREE && leaf_addr >= slot->leaf &&
+	leaf_addr - slot->leaf < FRAME_LEAF_SPAN &&
+	(slot->bitmap & (1 << (leaf_addr - slot->leaf)))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+/**
+ * Goes through the frames in flight with the last report from the
+ * base station. Those it has are done with, and any older than the
+ * newest it has that it hasn't got were lost.
+ */
+static void apply_report(void) {
+  uint8_t i, s, d;
+  struct upload_slot* slot;
+
+  if (!report_fresh) { return; }
+  report_fresh = 0;
+
+  for (i = 0; i < UPLOAD_WINDOW_MAX; i++) {
+    s = upload_next_seq - UPLOAD_WINDOW_MAX + i;
+    slot = slot_for(s);
+    d = report_seq - s;
+
+    if (slot->state == SLOT_FREE || d > UPLOAD_WINDOW_MAX) { continue; } /* Newer than the report */
+
+    if (d == 0 || (report_history & (1 << (d - 1)))) {
+      slot->state = SLOT_FREE;
+    } else {
+      slot->state = SLOT_LOST;
+    }
+  }
+}
+/**
+ * Called with each report from the base station.
+ */
+void upload_report(uint8_t seq, uint16_t history) {
+  report_seq = seq;
+  report_history = history;
+  report_fresh = 1;
+}
+
+/**
+ * Moves the oldest leaf marker on, unless something's been written
+ * behind it since we started looking.
+ */
+static void move_oldest_leaf_marker(uint32_t to) {
+  uint32_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  if (oldest_leaf_marker == leaf_marker_start) {
+    oldest_leaf_marker = to;
+  }
+  __set_PRIMASK(primask);
+}
+/**
+ * Adds a leaf to the frame we're putting together. Returns 0 if it
+ * doesn't fit, in which case the frame should be sent first. A leaf
+ * that's already in flight is skipped.
+ */
+static uint8_t add_to_frame(uint32_t leaf_addr) {
+  if (in_window(leaf_addr)) { return 1; }
+
+  if (frame_records == 0) {
+    frame_leaf = leaf_addr;
+    frame_bitmap = 0;
+  } else if (frame_records >= RECORDS_PER_FRAME ||
+	     leaf_addr < frame_leaf || leaf_addr - frame_leaf >= FRAME_LEAF_SPAN) {
+    return 0;
+  }
+
+  frame_bitmap |= 1 << (leaf_addr - frame_leaf);
+  frame_records++;
+
+  return 1;
+}
+/**
+ * Puts together the next new frame. Returns 0 if there's nothing more
+ * to upload this time.
+ */
+static uint8_t gather_frame(void) {
+  uint32_t marker, upload_addr;
+
+  frame_records = 0;
+
+  /* Records the base station has asked for again go first */
+  while (reupload_active) {
+    marker = reupload_marker;
+    upload_addr = next_record_in_range(&reupload_marker, reupload_from, reupload_to);
+
+    /* If there's nothing more in the range, carry on as usual */
+    if (upload_addr == 0xFFFFFFFF) { reupload_active = 0; break; }
+
+    if (!add_to_frame(reupload_marker)) { reupload_marker = marker; return 1; }
+  }
+  if (frame_records > 0) { return 1; }
+
+  /* After an outage the roll-ups go first, for an overview of it */
+  while (coarse_active && coarse_leaves_scanned < COARSE_LEAVES_AT_ONCE) {
+    marker = coarse_marker;
+    upload_addr = next_record(&coarse_marker, MEM_VALID, NO_WRAP);
+    coarse_leaves_scanned++;
+
+    /* If we've been through everything, carry on as usual */
+    if (upload_addr == 0xFFFFFFFF) { coarse_active = 0; break; }
+
+    if (IS_ROLLUP_RECORD(read_record_flags(coarse_marker)) &&
+	!add_to_frame(coarse_marker)) {
+      coarse_marker = marker; return 1;
+    }
+  }
+  if (frame_records > 0 || coarse_active) { return frame_records > 0; }
+
+  /* Then everything else, oldest first */
+  while (leaf_marker != 0xFFFFFFFF) {
+    marker = leaf_marker;
+    /* Get the address of the next readable leaf */
+    upload_addr = next_record(&leaf_marker, MEM_VALID, NO_WRAP);
+
+    /* Nothing before the first valid leaf needs looking at again */
+    if (!oldest_leaf_checked) {
+      oldest_leaf_checked = 1;
+      move_oldest_leaf_marker((upload_addr == 0xFFFFFFFF) ? leaf_marker : leaf_marker - 1);
+    }
+
+    if (upload_addr == 0xFFFFFFFF) { leaf_marker = 0xFFFFFFFF; break; }
+
+    if (!add_to_frame(leaf_marker)) { leaf_marker = marker; return 1; }
+  }
+
+  return frame_records > 0;
+}
+/**
+ * Sends the frame with the given sequence number, reading its records
+ * from the memory. When it's being sent again, leaves that have been
+ * erased since are left out. Returns the number of records sent.
+ */
+static uint8_t send_frame(uint8_t seq, uint8_t ack, uint8_t again) {
+  struct upload_slot* slot = slot_for(seq);
+  struct flash_stream stream;
+  uint32_t leaf_addr = slot->leaf;
+  uint8_t leaves[FRAME_LEAF_SPAN];
+  uint16_t trac_status;
+  uint8_t bit, records = 0;
+
+  if (again) {
+    ReadFlash(leaf_addr, leaves, FRAME_LEAF_SPAN);
+    for (bit = 0; bit < FRAME_LEAF_SPAN; bit++) {
+      if (leaves[bit] == LEAF_ERASED || leaves[bit] == LEAF_RESERVED) {
+	slot->bitmap &= ~(1 << bit);
+      }
+    }
+    /* Nothing's left of it */
+    if (slot->bitmap == 0) { slot->state = SLOT_FREE; return 0; }
+  }
+
+  /* The records are next to each other, so they're read in one go */
+  OpenFlashStream(&stream, leaf_addr_to_record_addr(leaf_addr));
+  for (bit = 0; bit < FRAME_LEAF_SPAN; bit++) {
+    if (slot->bitmap & (1 << bit)) {
+      stream_full_record(&stream, leaf_addr + bit, upload_record);
+      memcpy(upload_frame_buffer + FRAME_HEADER_SIZE + records*FULL_RECORD_SIZE,
+	     upload_record, FULL_RECORD_SIZE);
+      records++;
+    }
+  }
+  CloseFlashStream(&stream);
+
+  /* Set the frame header */
+  upload_frame_buffer[0] = 'P';
+  upload_frame_buffer[1] = seq;
   upload_frame_buffer[2] = leaf_addr & 0xFF; leaf_addr >>= 8;
   upload_frame_buffer[3] = leaf_addr & 0xFF; leaf_addr >>= 8;
-  upload_frame_buffer[4] = leaf_addr & 0xFF;
+  upload_frame_buffer[4] = leaf_addr & 0xFF; leaf_addr >>= 8;
+  upload_frame_buffer[5] = leaf_addr & 0xFF;
+  upload_frame_buffer[6] = slot->bitmap;
 
-  /* Read the record into the frame from memory */
-  ReadFlash(record_addr, upload_frame_buffer + HEADER_SIZE, RECORD_SIZE);
+  up_count += records;
+  slot->state = SLOT_SENT;
 
   /* Transmit the upload frame */
-  radio_transmit(upload_frame_buffer, HEADER_SIZE + RECORD_SIZE,
-	      BASE_STATION_ADDR, ack);
+  radio_transmit(upload_frame_buffer, FRAME_HEADER_SIZE + records*FULL_RECORD_SIZE,
+		 BASE_STATION_ADDR, ack);
+
+  /**
+   * The polls tell us if the base station is there. How they went is
+   * only known once the transmission's over, along with the report.
+   */
+  poll_answered = 0;
+  if (ack) {
+    trac_status = radio_wait_for_tx_end();
+    if (trac_status == TRAC_SUCCESS || trac_status == TRAC_SUCCESS_DATA_PENDING) {
+      poll_answered = 1;
+      missed_uploads = 0;
+    } else if (trac_status == TRAC_NO_ACK && missed_uploads < OUTAGE_UPLOADS &&
+	       ++missed_uploads == OUTAGE_UPLOADS) {
+      /* It's an outage. When it's over, look for roll-ups from the start */
+      coarse_marker = oldest_leaf_marker;
+      coarse_active = 1;
+    }
+  }
+
+  return records;
+}
+
+/**
+ * Queues up the records from between from and to inclusive to be
+ * uploaded again, even if they've already been acked.
+ */
+void request_reupload(uint64_t from, uint64_t to) {
+  reupload_from = from;
+  reupload_to = to;
+  reupload_marker = first_root();
+  reupload_active = 1;
 }
 
 /**
- * Carries out a number of uploads.
+ * Carries out a number of uploads, then writes out the invalidations
+ * for everything that was acked.
+ *
+ * Up to get_upload_window() frames are sent before we wait to hear
+ * back, each with its own sequence number. The base station reports
+ * which frames it has with each ack, and only the ones it's missing
+ * are sent again. The first frame, and the one that fills the window,
+ * ask for a MAC ack so we know the base station is there and get a
+ * report straight back. If it isn't, we stop until next time.
  */
 void upload(void) {
-  uint32_t leaf_marker, upload_addr;
-  uint8_t records_done_this_upload = 0;
+  uint8_t records_done = 0, frames = 0;
+  uint8_t seq, lost, ack, again, sent;
+  struct upload_slot* slot;
 
-  /* Start at the beginning of the memory space */
-  leaf_marker = first_root();
+  /* Anything we didn't hear back about last time goes again */
+  apply_report();
+  while (oldest_in_state(SLOT_SENT, &seq)) {
+    slot_for(seq)->state = SLOT_LOST;
+  }
 
-  do {
-    /* Get the address of the next readable leaf */
-    upload_addr = next_record(&leaf_marker, MEM_VALID, NO_WRAP);
+  /* Start from the oldest leaf that might not have been acked */
+  leaf_marker = leaf_marker_start = oldest_leaf_marker;
+  oldest_leaf_checked = 0;
+  coarse_leaves_scanned = 0;
 
-    /* If there's nothing more to read, return */
-    if (upload_addr == 0xFFFFFFFF) { return; }
+  while (records_done < MAX_UPLOADS_AT_ONCE) {
+    apply_report();
+    collect_invalidations();
+    ack = 0; again = 1;
 
-    if (records_done_this_upload < UPLOADS_WITHOUT_ACK) {
-      do_upload(upload_addr, leaf_marker, 1);
+    if (oldest_in_state(SLOT_LOST, &seq)) {
+      /* Send what the base station's missing first */
+    } else if (window_has_room() && gather_frame()) {
+      seq = upload_next_seq++;
+      slot = slot_for(seq);
+      slot->leaf = frame_leaf;
+      slot->bitmap = frame_bitmap;
+      again = 0;
+    } else if (oldest_in_state(SLOT_SENT, &seq)) {
+      /* The report on the last frame might still be on its way */
+      radio_wait_for_tx_end();
+      if (report_fresh) { continue; }
+      /* We've not heard about it, so send it again and ask */
+      ack = 1;
     } else {
-      if (radio_get_trac_status() == TRAC_NO_ACK) { break; }
-      do_upload(upload_addr, leaf_marker, 0);
+      break; /* Everything's been sent and received */
+    }
+
+    /* Ask for a report if we'd have to stop and wait for one next */
+    slot_for(seq)->state = SLOT_SENT;
+    if (frames == 0 || (!oldest_in_state(SLOT_LOST, &lost) && !window_has_room())) {
+      ack = 1;
     }
-  } while (++records_done_this_upload < MAX_UPLOADS_AT_ONCE);
+
+    sent = send_frame(seq, ack, again);
+    if (sent == 0) { continue; } /* Nothing was left to send */
+    records_done += sent;
+    frames++;
+
+    /* If the base station isn't there or didn't report back, try again next time */
+    if (ack && (!poll_answered || !report_fresh)) { break; }
+  }
+
+  flush_invalidations();
+  /* Don't leave the bus held when the radio's put to sleep */
+  WaitForAutoWrite();
 }
@@ -0,0 +1,188 @@
+/* 
+ * Puts a memory dump from a node back together as an image
+ * Copyright (C) 2013  Richard Meadows
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * The gateway logs each frame of a dump as a line of hex, and those
+ * lines go in on stdin. The bytes can be separated by spaces, and lines
+ * starting with '#' are ignored. Logs from several dumps of the same
+ * node can go in together, so the ranges asked for again fill in what
+ * the first one missed.
+ *
+ * The image is written with each chip at chip_size times its number.
+ * Anything that never arrived is left as zeros. Those ranges are
+ * printed to stdout as 'B' frames in hex, for the gateway to send.
+ *
+ *	cc -O2 -o dump_receiver dump_receiver.c
+ *	./dump_receiver -o node.img < dump.log > requests.hex
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#define MAX_CHIPS	256
+#define MAX_FRAME	127
+
+/**
+ * What we've got of each chip, and which bytes we've got
+ */
+static uint8_t* image[MAX_CHIPS];
+static uint8_t* covered[MAX_CHIPS];
+static uint32_t chip_size = 0x100000; /* An SST25WF080 */
+
+static uint32_t get_u32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static void put_u32(uint8_t* p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+/**
+ * Puts length bytes of data at address, or erased memory if data is
+ * NULL. Returns 0 if it's not in the memory.
+ */
+static int put_memory(uint32_t address, const uint8_t* data, uint32_t length) {
+  uint32_t chip = address >> 24, offset = address & 0x00FFFFFF, i;
+
+  if (offset + length > chip_size) { return 0; }
+  if (image[chip] == NULL) {
+    image[chip] = calloc(chip_size, 1);
+    covered[chip] = calloc(chip_size / 8, 1);
+    if (image[chip] == NULL || covered[chip] == NULL) {
+      fprintf(stderr, "Out of memory\n"); exit(1);
+    }
+  }
+
+  if (data) {
+    memcpy(image[chip] + offset, data, length);
+  } else {
+    memset(image[chip] + offset, 0xFF, length);
+  }
+  for (i = offset; i < offset + length; i++) {
+    covered[chip][i / 8] |= 1 << (i % 8);
+  }
+  return 1;
+}
+/**
+ * Reads a line of hex into frame. Returns the number of bytes.
+ */
+static int parse_frame(const char* line, uint8_t* frame) {
+  int length = 0, high = -1, digit;
+
+  for (; *line && length < MAX_FRAME; line++) {
+    if (!isxdigit((unsigned char)*line)) { continue; }
+    digit = isdigit((unsigned char)*line) ? *line - '0' : tolower((unsigned char)*line) - 'a' + 10;
+    if (high < 0) {
+      high = digit;
+    } else {
+      frame[length++] = (high << 4) | digit;
+      high = -1;
+    }
+  }
+  return length;
+}
+/**
+ * Prints a frame asking for the memory between from and to.
+ */
+static void print_request(uint32_t from, uint32_t to) {
+  uint8_t frame[9];
+  int i;
+
+  frame[0] = 'B';
+  put_u32(frame + 1, from);
+  put_u32(frame + 5, to);
+  for (i = 0; i < 9; i++) { printf("%02x%s", frame[i], i < 8 ? " " : "\n"); }
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage: %s -o image [-s chip size] < frames\n", name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  const char* image_path = NULL;
+  char line[1024];
+  uint8_t frame[MAX_FRAME];
+  uint32_t chip, i, from, frames = 0, ignored = 0, gaps = 0, missing = 0, last_chip = 0;
+  int length, opt, ends = 0;
+  FILE* out;
+
+  while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+    switch (opt) {
+      case 'o': image_path = optarg; break;
+      case 's': chip_size = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (image_path == NULL || chip_size == 0 || chip_size > 0x1000000 || chip_size % 8) {
+    usage(argv[0]);
+  }
+
+  while (fgets(line, sizeof(line), stdin)) {
+    if (line[0] == '#') { continue; }
+    length = parse_frame(line, frame);
+    if (length == 0) { continue; }
+
+    if (frame[0] == 'M' && length > 5) {
+      frames += put_memory(get_u32(frame + 1), frame + 5, length - 5);
+    } else if (frame[0] == 'N' && length >= 9) {
+      frames += put_memory(get_u32(frame + 1), NULL, get_u32(frame + 5));
+    } else if (frame[0] == 'E' && length >= 5) {
+      ends++;
+    } else {
+      ignored++;
+    }
+  }
+
+  /* Ask again for anything that's missing from the chips we've seen */
+  for (chip = 0; chip < MAX_CHIPS; chip++) {
+    if (covered[chip] == NULL) { continue; }
+    last_chip = chip;
+
+    for (i = 0; i < chip_size; ) {
+      if (covered[chip][i / 8] & (1 << (i % 8))) { i++; continue; }
+      for (from = i; i < chip_size && !(covered[chip][i / 8] & (1 << (i % 8))); i++);
+      print_request((chip << 24) | from, (chip << 24) | i);
+      gaps++; missing += i - from;
+    }
+  }
+
+  out = fopen(image_path, "wb");
+  if (out == NULL) { perror(image_path); return 1; }
+  for (chip = 0; chip <= last_chip; chip++) {
+    if (image[chip]) {
+      fwrite(image[chip], 1, chip_size, out);
+    } else {
+      for (i = 0; i < chip_size; i++) { fputc(0, out); }
+    }
+  }
+  fclose(out);
+
+  fprintf(stderr, "%u frames, %u ignored, %d ends. %u ranges (%u bytes) missing\n",
+	  frames, ignored, ends, gaps, missing);
+  return gaps ? 2 : 0;
+}